@@ -9,6 +9,9 @@
 #define ARG_TYPE_MEM    2
 #define ARG_TYPE_IMM    3
 #define ARG_TYPE_MEMREG 4
+#define ARG_TYPE_COND   5
+#define ARG_TYPE_LABEL  6
+#define ARG_TYPE_MASK   7
 #define ARG_TYPE_ANY    15
 
 #define ARG_SIZE_NONE   0
@@ -19,38 +22,129 @@
 #define ARG_SIZE_128    5
 #define ARG_SIZE_256    6
 #define ARG_SIZE_80     7
+#define ARG_SIZE_512    8
 #define ARG_SIZE_ANY   15
 
+// bytes in an operand, immediate or displacement field of the given size
+inline static uint8_t arg_size_bytes(uint8_t size) {
+    static const uint8_t size_bytes[] = {
+        [ARG_SIZE_NONE] = 0, [ARG_SIZE_8] = 1, [ARG_SIZE_16] = 2,
+        [ARG_SIZE_32] = 4, [ARG_SIZE_64] = 8, [ARG_SIZE_128] = 16,
+        [ARG_SIZE_256] = 32, [ARG_SIZE_80] = 10, [ARG_SIZE_512] = 64
+    };
+    return size <= ARG_SIZE_512 ? size_bytes[size] : 0;
+}
+
 ////////////////////////////////////////////////////////////////
 
 #include "register.h"
 #include "memory.h"
 #include "immediate.h"
+#include "condition.h"
 
+// Operands are 8 bytes: a header with the tag and the operand size, then
+// a register, a packed memory operand, a packed immediate, a condition code,
+// a label id or an EVEX write mask. The rare 64
+// bit immediates and displacements are escaped to the arg_wide pool, see
+// arg_wide_put. arg_to_mem and arg_to_imm unpack into the plain memory_t
+// and immediate_t the encoders work with.
 typedef struct {
+    uint8_t tag : 4;
+    uint8_t size : 4;
     union {
-       register_t reg;
-       memory_t mem;
-       immediate_t imm;
+        register_t reg;
+        packed_memory_t mem;
+        packed_immediate_t imm;
+        uint8_t cond;
+        uint32_t label __attribute__((packed));
+        opmask_t mask;
     };
-    uint8_t tag;
 } arg_t;
 
+_Static_assert(sizeof(arg_t) == 8, "arg_t must stay 8 bytes");
+
 #define arg_type(arg) ((arg).tag)
 #define arg_is_none(arg) ((arg).tag == ARG_TYPE_NONE)
 #define arg_is_reg(arg) ((arg).tag == ARG_TYPE_REG)
 #define arg_is_mem(arg) ((arg).tag == ARG_TYPE_MEM)
 #define arg_is_imm(arg) ((arg).tag == ARG_TYPE_IMM)
+#define arg_is_cond(arg) ((arg).tag == ARG_TYPE_COND)
+#define arg_is_label(arg) ((arg).tag == ARG_TYPE_LABEL)
+#define arg_is_mask(arg) ((arg).tag == ARG_TYPE_MASK)
+
+////////////////////////////////////////////////////////////////
+
+// Out of line storage for 64 bit payloads, slots stay valid until
+// arg_wide_reset. The pool is thread local like instr_error, so operands
+// with wide payloads have to be encoded on the thread that built them.
+
+static _Thread_local buffer_t arg_wide;
+
+#define arg_fits_32(val) ((int64_t) (val) == (int32_t) (val))
+
+// returned by arg_wide_put when the pool can't be mapped or grown, slots
+// never get this high
+#define ARG_WIDE_FAILED ((uint32_t) -1)
+
+inline static uint32_t arg_wide_put(uint64_t val) {
+    if (!arg_wide.data) {
+        arg_wide = alloc_buf_growable(1ull << 34, BUF_PAGE_SIZE);
+    }
+    if (!arg_wide.data || !buf_reserve(&arg_wide, 8)) {
+        return ARG_WIDE_FAILED;
+    }
+    uint32_t slot = arg_wide.cursor / 8;
+    buf_write_64(&arg_wide, val);
+    return slot;
+}
+
+inline static uint64_t arg_wide_get(uint32_t slot) {
+    uint64_t val;
+    memcpy(&val, arg_wide.data + (uint64_t) slot * 8, 8);
+    return val;
+}
+
+inline static void arg_wide_reset(void) {
+    arg_wide.cursor = 0;
+}
+
+// payloads that sign extend from 32 bits are stored inline
+#define arg_payload(val, wide) ((wide) ? arg_wide_get(val) : (uint64_t) (int64_t) (int32_t) (val))
+
+////////////////////////////////////////////////////////////////
 
 #define arg_to_reg(arg) ((arg).reg)
-#define arg_to_mem(arg) ((arg).mem)
-#define arg_to_imm(arg) ((arg).imm)
+#define arg_to_cond(arg) ((arg).cond)
+#define arg_to_label(arg) ((arg).label)
+#define arg_to_mask(arg) ((arg).mask)
+
+inline static memory_t arg_to_mem(arg_t arg) {
+    return (memory_t) {
+        .disp = arg_payload(arg.mem.disp, arg.mem.wide),
+        .base = {.id = arg.mem.base_id, .type = arg.mem.base_type},
+        .index = {.id = arg.mem.index_id, .type = arg.mem.index_type},
+        .segment = arg.mem.segment
+            ? (register_t) {.id = arg.mem.segment - 1, .type = REGISTER_TYPE_SEGMENT}
+            : REGISTER_NONE,
+        .scale = arg.mem.scale,
+        .disp_size = arg.mem.disp_size,
+        .size = arg.size
+    };
+}
+
+inline static immediate_t arg_to_imm(arg_t arg) {
+    uint64_t data = arg.imm.data;
+    if (arg.size == ARG_SIZE_64) {
+        data = arg_payload(arg.imm.data, arg.imm.wide);
+    }
+    return (immediate_t) {.data = data, .size = arg.size};
+}
 
 inline static uint8_t arg_size(arg_t arg) {
     switch (arg_type(arg)) {
     case ARG_TYPE_REG: return register_size(arg_to_reg(arg));
-    case ARG_TYPE_MEM: return memory_size(arg_to_mem(arg));
-    case ARG_TYPE_IMM: return immediate_size(arg_to_imm(arg));
+    case ARG_TYPE_MEM:
+    case ARG_TYPE_IMM: return arg.size;
     }
     return ARG_SIZE_NONE;
 }
@@ -109,19 +203,51 @@ inline static arg_t arg_mem(arg_t    arg_base,
         return arg_none;
     }*/
 
+    // base and index are stored with 4 bit ids and 3 bit types, which
+    // covers the general purpose and ip registers that can address memory
+    if (register_type(base) > 7 || register_type(index) > 7 ||
+        register_id(base) > 15 || register_id(index) > 15) {
+        return arg_none;
+    }
+
+    bool wide = !arg_fits_32(disp);
+    if (wide) {
+        disp = arg_wide_put(disp);
+        if (disp == ARG_WIDE_FAILED) {
+            return arg_none;
+        }
+    }
+
     return (arg_t) {
         .tag = ARG_TYPE_MEM,
+        .size = size,
         .mem = {
-            .scale = scale,
-            .index = index,
-            .base = base,
             .disp = disp,
+            .base_id = register_id(base),
+            .base_type = register_type(base),
+            .index_id = register_id(index),
+            .index_type = register_type(index),
+            .scale = scale,
             .disp_size = disp_size,
-            .size = size
+            .wide = wide
         }
     };
 }
 
+// The memory operand mem addressed through the segment register arg_seg,
+// in 64 bit code only fs and gs have a base, which points at the thread
+// local block. Without a base or index register the displacement is an
+// absolute offset into the segment, fs:[disp32].
+inline static arg_t arg_mem_segment(arg_t arg_seg, arg_t mem) {
+    if (!arg_is_mem(mem) || !arg_is_reg(arg_seg) ||
+        !register_is_segment(arg_to_reg(arg_seg)) ||
+        register_id(arg_to_reg(arg_seg)) > 5) {
+        return arg_none;
+    }
+    mem.mem.segment = register_id(arg_to_reg(arg_seg)) + 1;
+    return mem;
+}
+
 inline static arg_t arg_imm(uint64_t data, uint8_t size) {
     switch (size) {
     case ARG_SIZE_8:
@@ -138,12 +264,52 @@ inline static arg_t arg_imm(uint64_t data, uint8_t size) {
     default:
         return arg_none;
     }
+    bool wide = size == ARG_SIZE_64 && !arg_fits_32(data);
+    if (wide) {
+        data = arg_wide_put(data);
+        if (data == ARG_WIDE_FAILED) {
+            return arg_none;
+        }
+    }
     return (arg_t) {
         .tag = ARG_TYPE_IMM,
-        .imm = {.data = data, .size = size}
+        .size = size,
+        .imm = {.data = data, .wide = wide}
+    };
+}
+
+inline static arg_t arg_cond(uint8_t cond) {
+    if (cond > COND_G) {
+        return arg_none;
+    }
+    return (arg_t) {
+        .tag = ARG_TYPE_COND,
+        .cond = cond
     };
 }
 
+inline static arg_t arg_label(uint32_t label) {
+    return (arg_t) {
+        .tag = ARG_TYPE_LABEL,
+        .label = label
+    };
+}
+
+// goes after the other operands of an EVEX instruction, masks with the
+// opmask register arg_k and either merges or zeroes the masked elements
+inline static arg_t arg_opmask(arg_t arg_k, bool zeroing) {
+    if (!arg_is_reg(arg_k) || !register_is_mask(arg_to_reg(arg_k))) {
+        return arg_none;
+    }
+    return (arg_t) {
+        .tag = ARG_TYPE_MASK,
+        .mask = {.id = register_id(arg_to_reg(arg_k)), .zeroing = zeroing}
+    };
+}
+
+#define arg_mask(arg_k) arg_opmask(arg_k, false)
+#define arg_mask_z(arg_k) arg_opmask(arg_k, true)
+
 ////////////////////////////////////////////////////////////////
 
 #define arg_reg_none arg_reg(REGISTER_TYPE_NONE, 0)
@@ -158,6 +324,8 @@ inline static arg_t arg_imm(uint64_t data, uint8_t size) {
 #define arg_reg_mmx(reg_id) arg_reg(REGISTER_TYPE_MMX, reg_id)
 #define arg_reg_xmm(reg_id) arg_reg(REGISTER_TYPE_XMM, reg_id)
 #define arg_reg_ymm(reg_id) arg_reg(REGISTER_TYPE_YMM, reg_id)
+#define arg_reg_zmm(reg_id) arg_reg(REGISTER_TYPE_ZMM, reg_id)
+#define arg_reg_mask(reg_id) arg_reg(REGISTER_TYPE_MASK, reg_id)
 #define arg_reg_segment(reg_id) arg_reg(REGISTER_TYPE_SEGMENT, reg_id)
 #define arg_reg_control(reg_id) arg_reg(REGISTER_TYPE_CONTROL, reg_id)
 #define arg_reg_debug(reg_id) arg_reg(REGISTER_TYPE_DEBUG, reg_id)
@@ -170,6 +338,27 @@ inline static arg_t arg_imm(uint64_t data, uint8_t size) {
     arg_mem(base, index, scale, disp, disp_size, ARG_SIZE_32)
 #define arg_mem_64(base, index, scale, disp, disp_size) \
     arg_mem(base, index, scale, disp, disp_size, ARG_SIZE_64)
+#define arg_mem_128(base, index, scale, disp, disp_size) \
+    arg_mem(base, index, scale, disp, disp_size, ARG_SIZE_128)
+#define arg_mem_256(base, index, scale, disp, disp_size) \
+    arg_mem(base, index, scale, disp, disp_size, ARG_SIZE_256)
+#define arg_mem_512(base, index, scale, disp, disp_size) \
+    arg_mem(base, index, scale, disp, disp_size, ARG_SIZE_512)
+
+#define arg_mem_8_auto(base, index, scale, disp) \
+    arg_mem_8(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_16_auto(base, index, scale, disp) \
+    arg_mem_16(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_32_auto(base, index, scale, disp) \
+    arg_mem_32(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_64_auto(base, index, scale, disp) \
+    arg_mem_64(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_128_auto(base, index, scale, disp) \
+    arg_mem_128(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_256_auto(base, index, scale, disp) \
+    arg_mem_256(base, index, scale, disp, MEMORY_DISP_AUTO)
+#define arg_mem_512_auto(base, index, scale, disp) \
+    arg_mem_512(base, index, scale, disp, MEMORY_DISP_AUTO)
 
 #define arg_mem_8_disp_8(disp) \
     arg_mem_8(arg_reg_none, arg_reg_none, 0, disp, ARG_SIZE_8)
@@ -200,6 +389,15 @@ inline static arg_t arg_imm(uint64_t data, uint8_t size) {
     arg_mem_32(base, arg_reg_none, 0, 0, ARG_SIZE_NONE)
 #define arg_mem_64_base(base) \
     arg_mem_64(base, arg_reg_none, 0, 0, ARG_SIZE_NONE)
+#define arg_mem_128_base(base) \
+    arg_mem_128(base, arg_reg_none, 0, 0, ARG_SIZE_NONE)
+#define arg_mem_256_base(base) \
+    arg_mem_256(base, arg_reg_none, 0, 0, ARG_SIZE_NONE)
+#define arg_mem_512_base(base) \
+    arg_mem_512(base, arg_reg_none, 0, 0, ARG_SIZE_NONE)
+
+#define arg_mem_fs(mem) arg_mem_segment(arg_reg_segment(4), mem)
+#define arg_mem_gs(mem) arg_mem_segment(arg_reg_segment(5), mem)
 
 #define arg_imm_8(data) arg_imm(data, ARG_SIZE_8)
 #define arg_imm_16(data) arg_imm(data, ARG_SIZE_16)
@@ -219,6 +417,15 @@ inline static void print_arg(arg_t arg) {
     case ARG_TYPE_MEM:
         print_mem(arg_to_mem(arg));
         break;
+    case ARG_TYPE_COND:
+        print_cond(arg_to_cond(arg));
+        break;
+    case ARG_TYPE_LABEL:
+        printf("label(%u)", arg_to_label(arg));
+        break;
+    case ARG_TYPE_MASK:
+        printf("mask(%d%s)", arg_to_mask(arg).id, arg_to_mask(arg).zeroing ? ", Z" : "");
+        break;
     default:
         printf("ARG_BAD");
         break;
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
@@ -10,6 +12,7 @@
 #include "instruction.h"
 #include "instruction_instance.h"
 #include "instruction_write.c"
+#include "instruction_label.c"
 
 ////////////////////////////////////////////////////////////////
 
@@ -22,6 +25,119 @@
 
 #define NOP(...) make_instr(OP_NOP, __VA_ARGS__)
 #define ADD(...) make_instr(OP_ADD, __VA_ARGS__)
+#define JMP(...) make_instr(OP_JMP, __VA_ARGS__)
+#define JCC(...) make_instr(OP_JCC, __VA_ARGS__)
+#define CALL(...) make_instr(OP_CALL, __VA_ARGS__)
+#define LABEL(...) make_instr(OP_LABEL, __VA_ARGS__)
+#define ALIGN(...) make_instr(OP_ALIGN, __VA_ARGS__)
+#define SETCC(...) make_instr(OP_SETCC, __VA_ARGS__)
+#define CMOVCC(...) make_instr(OP_CMOVCC, __VA_ARGS__)
+
+#define OR(...) make_instr(OP_OR, __VA_ARGS__)
+#define ADC(...) make_instr(OP_ADC, __VA_ARGS__)
+#define SBB(...) make_instr(OP_SBB, __VA_ARGS__)
+#define AND(...) make_instr(OP_AND, __VA_ARGS__)
+#define SUB(...) make_instr(OP_SUB, __VA_ARGS__)
+#define XOR(...) make_instr(OP_XOR, __VA_ARGS__)
+#define CMP(...) make_instr(OP_CMP, __VA_ARGS__)
+#define ROL(...) make_instr(OP_ROL, __VA_ARGS__)
+#define ROR(...) make_instr(OP_ROR, __VA_ARGS__)
+#define RCL(...) make_instr(OP_RCL, __VA_ARGS__)
+#define RCR(...) make_instr(OP_RCR, __VA_ARGS__)
+#define SHL(...) make_instr(OP_SHL, __VA_ARGS__)
+#define SHR(...) make_instr(OP_SHR, __VA_ARGS__)
+#define SAR(...) make_instr(OP_SAR, __VA_ARGS__)
+#define NOT(...) make_instr(OP_NOT, __VA_ARGS__)
+#define NEG(...) make_instr(OP_NEG, __VA_ARGS__)
+#define MUL(...) make_instr(OP_MUL, __VA_ARGS__)
+#define IMUL(...) make_instr(OP_IMUL, __VA_ARGS__)
+#define DIV(...) make_instr(OP_DIV, __VA_ARGS__)
+#define IDIV(...) make_instr(OP_IDIV, __VA_ARGS__)
+#define TEST(...) make_instr(OP_TEST, __VA_ARGS__)
+#define MOV(...) make_instr(OP_MOV, __VA_ARGS__)
+#define MOVZX(...) make_instr(OP_MOVZX, __VA_ARGS__)
+#define MOVSX(...) make_instr(OP_MOVSX, __VA_ARGS__)
+#define INC(...) make_instr(OP_INC, __VA_ARGS__)
+#define DEC(...) make_instr(OP_DEC, __VA_ARGS__)
+#define XCHG(...) make_instr(OP_XCHG, __VA_ARGS__)
+#define XADD(...) make_instr(OP_XADD, __VA_ARGS__)
+#define CMPXCHG(...) make_instr(OP_CMPXCHG, __VA_ARGS__)
+#define CMPXCHG8B(...) make_instr(OP_CMPXCHG8B, __VA_ARGS__)
+#define CMPXCHG16B(...) make_instr(OP_CMPXCHG16B, __VA_ARGS__)
+#define MOVNTI(...) make_instr(OP_MOVNTI, __VA_ARGS__)
+#define MOVNTDQ(...) make_instr(OP_MOVNTDQ, __VA_ARGS__)
+#define SFENCE(...) make_instr(OP_SFENCE, __VA_ARGS__)
+#define PREFETCHT0(...) make_instr(OP_PREFETCHT0, __VA_ARGS__)
+#define PREFETCHT1(...) make_instr(OP_PREFETCHT1, __VA_ARGS__)
+#define PREFETCHT2(...) make_instr(OP_PREFETCHT2, __VA_ARGS__)
+#define PREFETCHNTA(...) make_instr(OP_PREFETCHNTA, __VA_ARGS__)
+#define PREFETCHW(...) make_instr(OP_PREFETCHW, __VA_ARGS__)
+
+// LOCK(ADD(arg_mem_64_base(RDI), RAX)), only for op_lockable ops with a
+// memory destination
+#define LOCK(instr_) instr_lock(instr_)
+
+// WIDEN(ADD(CX, arg_imm_16(0x1234))) drops the length changing prefix by
+// writing ecx, only when bits 16 to 63 of the register and the flags are dead
+#define WIDEN(instr_) instr_widen(instr_)
+
+#define POPCNT(...) make_instr(OP_POPCNT, __VA_ARGS__)
+#define LZCNT(...) make_instr(OP_LZCNT, __VA_ARGS__)
+#define TZCNT(...) make_instr(OP_TZCNT, __VA_ARGS__)
+#define CRC32(...) make_instr(OP_CRC32, __VA_ARGS__)
+#define PMULLD(...) make_instr(OP_PMULLD, __VA_ARGS__)
+#define PMINSD(...) make_instr(OP_PMINSD, __VA_ARGS__)
+#define PMAXSD(...) make_instr(OP_PMAXSD, __VA_ARGS__)
+#define PMINUD(...) make_instr(OP_PMINUD, __VA_ARGS__)
+#define PMAXUD(...) make_instr(OP_PMAXUD, __VA_ARGS__)
+#define PCMPEQQ(...) make_instr(OP_PCMPEQQ, __VA_ARGS__)
+#define PCMPGTQ(...) make_instr(OP_PCMPGTQ, __VA_ARGS__)
+#define PTEST(...) make_instr(OP_PTEST, __VA_ARGS__)
+#define PEXTRD(...) make_instr(OP_PEXTRD, __VA_ARGS__)
+#define PEXTRQ(...) make_instr(OP_PEXTRQ, __VA_ARGS__)
+#define PINSRD(...) make_instr(OP_PINSRD, __VA_ARGS__)
+#define PINSRQ(...) make_instr(OP_PINSRQ, __VA_ARGS__)
+
+#define VPADDD(...) make_instr(OP_VPADDD, __VA_ARGS__)
+#define VPADDQ(...) make_instr(OP_VPADDQ, __VA_ARGS__)
+#define VPAND(...) make_instr(OP_VPAND, __VA_ARGS__)
+#define VPXOR(...) make_instr(OP_VPXOR, __VA_ARGS__)
+#define VMOVDQU(...) make_instr(OP_VMOVDQU, __VA_ARGS__)
+#define VMOVNTDQ(...) make_instr(OP_VMOVNTDQ, __VA_ARGS__)
+#define VPBROADCASTB(...) make_instr(OP_VPBROADCASTB, __VA_ARGS__)
+#define VPBROADCASTW(...) make_instr(OP_VPBROADCASTW, __VA_ARGS__)
+#define VPBROADCASTD(...) make_instr(OP_VPBROADCASTD, __VA_ARGS__)
+#define VPBROADCASTQ(...) make_instr(OP_VPBROADCASTQ, __VA_ARGS__)
+#define VPERMD(...) make_instr(OP_VPERMD, __VA_ARGS__)
+#define VFMADD132PS(...) make_instr(OP_VFMADD132PS, __VA_ARGS__)
+#define VFMADD213PS(...) make_instr(OP_VFMADD213PS, __VA_ARGS__)
+#define VFMADD231PS(...) make_instr(OP_VFMADD231PS, __VA_ARGS__)
+#define VFMADD132PD(...) make_instr(OP_VFMADD132PD, __VA_ARGS__)
+#define VFMADD213PD(...) make_instr(OP_VFMADD213PD, __VA_ARGS__)
+#define VFMADD231PD(...) make_instr(OP_VFMADD231PD, __VA_ARGS__)
+#define SHLX(...) make_instr(OP_SHLX, __VA_ARGS__)
+#define SARX(...) make_instr(OP_SARX, __VA_ARGS__)
+#define SHRX(...) make_instr(OP_SHRX, __VA_ARGS__)
+#define RORX(...) make_instr(OP_RORX, __VA_ARGS__)
+#define BZHI(...) make_instr(OP_BZHI, __VA_ARGS__)
+#define PDEP(...) make_instr(OP_PDEP, __VA_ARGS__)
+#define PEXT(...) make_instr(OP_PEXT, __VA_ARGS__)
+#define ANDN(...) make_instr(OP_ANDN, __VA_ARGS__)
+#define BLSR(...) make_instr(OP_BLSR, __VA_ARGS__)
+#define MULX(...) make_instr(OP_MULX, __VA_ARGS__)
+#define VPANDD(...) make_instr(OP_VPANDD, __VA_ARGS__)
+#define VPANDQ(...) make_instr(OP_VPANDQ, __VA_ARGS__)
+#define VPXORD(...) make_instr(OP_VPXORD, __VA_ARGS__)
+#define VPXORQ(...) make_instr(OP_VPXORQ, __VA_ARGS__)
+#define VMOVDQU32(...) make_instr(OP_VMOVDQU32, __VA_ARGS__)
+#define VMOVDQU64(...) make_instr(OP_VMOVDQU64, __VA_ARGS__)
+#define VPCMPEQD(...) make_instr(OP_VPCMPEQD, __VA_ARGS__)
+#define VPCMPGTD(...) make_instr(OP_VPCMPGTD, __VA_ARGS__)
+#define VPCOMPRESSD(...) make_instr(OP_VPCOMPRESSD, __VA_ARGS__)
+#define VPCOMPRESSQ(...) make_instr(OP_VPCOMPRESSQ, __VA_ARGS__)
+#define VPEXPANDD(...) make_instr(OP_VPEXPANDD, __VA_ARGS__)
+#define VPEXPANDQ(...) make_instr(OP_VPEXPANDQ, __VA_ARGS__)
+#define KMOVW(...) make_instr(OP_KMOVW, __VA_ARGS__)
 
 ////////////////////////////////////////////////////////////////
 
@@ -30,29 +146,86 @@ inline static void emit(buffer_t* buf, instr_t instr) {
     if (instance_is_valid(instance)) {
         printf("good instr: ");
         print_instr(instr);
-        write_instruction_instance(buf, instance);
+        if (instance_has_lcp(instance)) {
+            printf("  length changing prefix\n");
+        }
+        if (!write_instruction_instance(buf, instance)) {
+            printf("out of buffer space at cursor 0x%lx\n", buf->cursor);
+        }
     }
     else {
         printf(
-            "bad instruction returned at line %lu in %s: ",
-            instance.disp,
-            (char*) instance.imm
+            "bad instruction returned at line %u in %s: ",
+            instr_error.line,
+            instr_error.file
         );
         print_instr(instr);
     }
     buf->cursor = (((buf->cursor) >> 8) + 1) << 8;
 }
 
+// instructions per capacity check in emit_batch
+#define EMIT_BATCH_BLOCK 256
+
+// Instantiates and writes n instructions back to back, without printing or
+// padding. A failing instruction writes nothing and the batch carries on:
+// bit i of errors (which holds (n + 63) / 64 words) is set when instrs[i]
+// could not be encoded or didn't fit. Returns the number of failures.
+inline static uint64_t emit_batch(buffer_t* buf,
+                                  instr_t*  instrs,
+                                  uint64_t  n,
+                                  uint64_t* errors) {
+    memset(errors, 0, ((n + 63) / 64) * sizeof(uint64_t));
+    uint64_t failures = 0;
+
+    for (uint64_t block = 0; block < n; block += EMIT_BATCH_BLOCK) {
+        uint64_t end = block + EMIT_BATCH_BLOCK < n ? block + EMIT_BATCH_BLOCK : n;
+        // room for the rest of the block, so the common case below writes
+        // without any capacity checks. The jcc erratum mode needs the
+        // checked writer for every instruction.
+        bool reserved = !jcc_erratum.enabled &&
+                        buf_reserve(buf, (end - block) * STAGING_SIZE);
+
+        for (uint64_t i = block; i < end; i++) {
+            instr_instance_t instance = instruction_instantiate(instrs[i]);
+            if (__builtin_expect(reserved &&
+                                 instance_is_valid(instance) &&
+                                 !instance_is_padding(instance), true)) {
+                staging_t stage = {0};
+                stage_instruction_instance(&stage, instance);
+                buf_commit(buf, stage);
+                continue;
+            }
+
+            // padding, invalid instances and a buffer that couldn't be grown
+            // for the whole block go through the checked writer
+            if (!write_instruction_instance(buf, instance)) {
+                errors[i / 64] |= 1ull << (i % 64);
+                failures++;
+            }
+            else if (instance_is_padding(instance)) {
+                reserved = !jcc_erratum.enabled &&
+                           buf_reserve(buf, (end - i - 1) * STAGING_SIZE);
+            }
+        }
+    }
+    return failures;
+}
+
 ////////////////////////////////////////////////////////////////
 
+// the bench_*.c drivers include this file and bring their own main
+#ifndef ASSEMBLER_NO_DEMO
+
 int main(void) {
     uint64_t bufsize = 4096;
-    buffer_t buf = alloc_buf(bufsize);
+    buffer_t buf = alloc_buf_growable(1 << 30, bufsize);
 
     emit(&buf, NOP(arg_imm_8(1)));
     emit(&buf, NOP(arg_imm_8(2)));
     emit(&buf, NOP(arg_imm_8(3)));
 
+    buf_reserve(&buf, 16);
     buf_write_64(&buf, 0);
     buf_write_64(&buf, 0);
 
@@ -67,7 +240,24 @@ int main(void) {
     emit(&buf, ADD(arg_mem_64(RIP, arg_reg_none, 0, 0, ARG_SIZE_32), arg_imm_32(0xffffffff)));
     emit(&buf, ADD(arg_mem_32(EIP, arg_reg_none, 0, 0, ARG_SIZE_32), arg_imm_32(0xffffffff)));
     emit(&buf, ADD(arg_mem_64(RAX, arg_reg_none, 0, 0, ARG_SIZE_32), RDX));
+    emit(&buf, ADD(CX, arg_imm_16(0x1234)));
+    emit(&buf, WIDEN(ADD(CX, arg_imm_16(0x1234))));
+
+    // opmask registers are 64 bits like rcx, but only fit mask slots, so
+    // none of these encode
+    emit(&buf, ADD(RAX, K1));
+    emit(&buf, MOV(K1, RAX));
+    emit(&buf, KMOVW(RAX, RCX));
+    emit(&buf, VPCMPEQD(RAX, ZMM1, ZMM2));
+    emit(&buf, SHLX(K1, RBX, RCX));
+
+    // neither do segment, control or mmx registers in general purpose slots
+    emit(&buf, MOV(AX, FS));
+    emit(&buf, MOV(EAX, CR0));
+    emit(&buf, ADD(MM0, RAX));
 
     buf_hexdump(buf);
     return 0;
 }
+
+#endif
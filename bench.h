@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////
+
+// Timing shared by the bench_*.c drivers. Each driver is a single
+// translation unit that includes assembler.c without its demo:
+//
+//   cc -O2 -o bench_emit bench_emit.c && ./bench_emit
+//
+// Runs are repeated and the fastest one is reported, which filters out
+// page faults, frequency ramp up and other one-off noise.
+
+#define BENCH_RUNS 7
+
+inline static double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// keeps the compiler from dropping or hoisting work whose result is unused
+#define bench_keep(val) __asm__ volatile("" : : "r"(val) : "memory")
+
+// runs body BENCH_RUNS times and stores the fastest in ns per iteration,
+// for a body that does n iterations
+#define bench_best(ns, n, ...) do { \
+    double best_ = 1e30; \
+    for (int run_ = 0; run_ < BENCH_RUNS; run_++) { \
+        double start_ = bench_now(); \
+        __VA_ARGS__; \
+        double time_ = bench_now() - start_; \
+        best_ = time_ < best_ ? time_ : best_; \
+    } \
+    (ns) = best_ * 1e9 / (n); \
+} while (0)
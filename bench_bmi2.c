@@ -0,0 +1,104 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// BMI2 bit field extraction: runs generated code that extracts a field
+// with shrx + bzhi against the legacy shr cl + and sequence, on four
+// independent chains per step so both are bound by throughput rather
+// than by the latency of a single chain. Each step of a chain is
+//   v = ((v >> start) & ((1 << len) - 1)) + k
+// The legacy version keeps the mask in r8 and the shift count in cl, the
+// way a compiler targeting pre-BMI2 cores would.
+
+#define BMI2_STEPS 4096
+#define BMI2_CALLS 20000
+#define BMI2_CHAINS 4
+
+// f(k, v, start, len), following SysV: rdi, rsi, rdx and rcx
+typedef uint64_t (*bench_extract_t)(uint64_t k, uint64_t v, uint64_t start, uint64_t len);
+
+static bool bench_write(buffer_t* buf, instr_t instr) {
+    return write_instruction_instance(buf, instruction_instantiate(instr));
+}
+
+static bench_extract_t bench_extract(buffer_t* buf, bool bmi2) {
+    arg_t chains[BMI2_CHAINS] = {RAX, R9, R10, R11};
+    uint64_t start = buf->cursor;
+    bool ok = true;
+    for (int c = 0; c < BMI2_CHAINS; c++) {
+        ok = ok && bench_write(buf, MOV(chains[c], RSI));
+    }
+    if (!bmi2) {
+        ok = ok &&
+             bench_write(buf, MOV(R8D, arg_imm_32(1))) &&
+             bench_write(buf, SHL(R8, CL)) &&
+             bench_write(buf, DEC(R8)) &&
+             bench_write(buf, MOV(ECX, EDX));
+    }
+    for (int i = 0; i < BMI2_STEPS && ok; i++) {
+        for (int c = 0; c < BMI2_CHAINS && ok; c++) {
+            arg_t v = chains[c];
+            if (bmi2) {
+                ok = bench_write(buf, SHRX(v, v, RDX)) &&
+                     bench_write(buf, BZHI(v, v, RCX));
+            }
+            else {
+                ok = bench_write(buf, SHR(v, CL)) &&
+                     bench_write(buf, AND(v, R8));
+            }
+            ok = ok && bench_write(buf, ADD(v, RDI));
+        }
+    }
+    for (int c = 1; c < BMI2_CHAINS; c++) {
+        ok = ok && bench_write(buf, ADD(RAX, chains[c]));
+    }
+    if (!ok || !buf_reserve(buf, 1)) {
+        return NULL;
+    }
+    buf_write_8(buf, 0xc3);
+    return (bench_extract_t) buf_exec_addr(buf, start);
+}
+
+int main(void) {
+    if (!__builtin_cpu_supports("bmi2")) {
+        printf("this cpu has no BMI2\n");
+        return 1;
+    }
+
+    buffer_t buf = alloc_buf_exec(1 << 20);
+    bench_extract_t bmi2 = bench_extract(&buf, true);
+    bench_extract_t legacy = bench_extract(&buf, false);
+    if (!bmi2 || !legacy) {
+        printf("failed to write the extraction code\n");
+        return 1;
+    }
+    uint64_t expected = legacy(0x1234567, 0xdeadbeefcafebabe, 5, 40);
+    if (bmi2(0x1234567, 0xdeadbeefcafebabe, 5, 40) != expected) {
+        printf("bmi2 and legacy results differ\n");
+        return 1;
+    }
+
+    double ns_bmi2, ns_legacy;
+    double steps = (double) BMI2_CALLS * BMI2_STEPS;
+    bench_best(ns_bmi2, steps, {
+        uint64_t v = 0;
+        for (int i = 0; i < BMI2_CALLS; i++) {
+            v = bmi2(i, v, 5, 40);
+        }
+        bench_keep(v);
+    });
+    bench_best(ns_legacy, steps, {
+        uint64_t v = 0;
+        for (int i = 0; i < BMI2_CALLS; i++) {
+            v = legacy(i, v, 5, 40);
+        }
+        bench_keep(v);
+    });
+
+    printf("ns per step of %d chains, best of %d runs\n", BMI2_CHAINS, BENCH_RUNS);
+    printf("shrx + bzhi      %6.3f\n", ns_bmi2);
+    printf("shr cl + and     %6.3f\n", ns_legacy);
+    return 0;
+}
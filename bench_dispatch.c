@@ -0,0 +1,108 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// Schema dispatch: the linear match_schema scan against the lookup_schema
+// hash table, per match, on an 8-form ADD mix. Also checks over random ADD
+// operand combinations that the table finds a schema whenever the scan
+// does. The table takes an immediate in any slot it fits (ADD(RAX,
+// arg_imm_16(0x1234)) gets the imm32 form), which the scan rejects, so the
+// table may accept more, but only for forms with an immediate. The two may
+// also pick different schemata for the same operands, since the table
+// prefers the shortest encoding.
+
+#define DISPATCH_MATCHES (20 * 1000 * 1000)
+#define DISPATCH_RANDOM (200 * 1000)
+#define DISPATCH_MIX 8
+
+// xorshift, since stdlib.h's register_t would clash with ours
+static uint32_t dispatch_seed = 1;
+
+inline static uint32_t dispatch_random(void) {
+    dispatch_seed ^= dispatch_seed << 13;
+    dispatch_seed ^= dispatch_seed >> 17;
+    dispatch_seed ^= dispatch_seed << 5;
+    return dispatch_seed;
+}
+
+// one value per immediate size, each needing all of it
+static const uint64_t dispatch_imms[4] = {0x12, 0x1234, 0x12345678, 0x123456789};
+
+inline static arg_t dispatch_random_arg(uint32_t r) {
+    switch (r % 4) {
+    case 0:
+        return arg_reg(1 + (r >> 2) % 7, (r >> 5) & 15);
+    case 1:
+        return arg_mem(arg_reg_64((r >> 2) & 15), arg_reg_none, 0, 0,
+                       ARG_SIZE_NONE, 1 + (r >> 6) % 4);
+    case 2:
+        return arg_imm(dispatch_imms[(r >> 2) % 4], ARG_SIZE_8 + (r >> 2) % 4);
+    }
+    return RAX;
+}
+
+int main(void) {
+    uint32_t accepted = 0;
+    uint32_t missed = 0;
+    uint32_t extra_imm = 0;
+    uint32_t extra = 0;
+    for (int i = 0; i < DISPATCH_RANDOM; i++) {
+        arg_t args[3] = {
+            dispatch_random_arg(dispatch_random()),
+            dispatch_random_arg(dispatch_random()),
+            dispatch_random_arg(dispatch_random()),
+        };
+        instr_t instr = {.op = OP_ADD, .args = args, .len = 1 + dispatch_random() % 3};
+        bool linear = match_schema(add_schemata, instr) != (uint32_t) -1;
+        bool table = lookup_schema(instr) != NULL;
+        bool imm = false;
+        for (int j = 0; j < instr.len; j++) {
+            imm |= arg_is_imm(args[j]);
+        }
+        accepted += table;
+        missed += linear && !table;
+        extra_imm += table && !linear && imm;
+        extra += table && !linear && !imm;
+    }
+
+    arg_t mix[DISPATCH_MIX][2] = {
+        {EAX, arg_imm_32(0x12345)},
+        {RAX, RDX},
+        {RCX, arg_imm_8(1)},
+        {arg_mem_64_base(RSP), arg_imm_8(8)},
+        {R8, arg_mem_64_base(RBX)},
+        {ECX, EDX},
+        {AL, arg_imm_8(1)},
+        {arg_mem_32_base(RDI), EAX},
+    };
+    instr_t instrs[DISPATCH_MIX];
+    for (int i = 0; i < DISPATCH_MIX; i++) {
+        instrs[i] = (instr_t) {.op = OP_ADD, .args = mix[i], .len = 2};
+        if (!lookup_schema(instrs[i])) {
+            printf("form %d has no schema\n", i);
+            return 1;
+        }
+    }
+
+    double linear, table;
+    bench_best(linear, DISPATCH_MATCHES, {
+        for (int i = 0; i < DISPATCH_MATCHES; i++) {
+            bench_keep(match_schema(add_schemata, instrs[i % DISPATCH_MIX]));
+        }
+    });
+    bench_best(table, DISPATCH_MATCHES, {
+        for (int i = 0; i < DISPATCH_MATCHES; i++) {
+            bench_keep(lookup_schema(instrs[i % DISPATCH_MIX]));
+        }
+    });
+
+    printf("table: %u slots\n", schema_dispatch.mask + 1);
+    printf("%d random ADD forms: %u accepted by the table, %u missed, "
+           "%u extra with an immediate, %u other extra\n",
+           DISPATCH_RANDOM, accepted, missed, extra_imm, extra);
+    printf("linear %6.2f ns/match\n", linear);
+    printf("table  %6.2f ns/match\n", table);
+    return missed || extra;
+}
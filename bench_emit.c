@@ -0,0 +1,76 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// Emission throughput: cost of the capacity check in
+// write_instruction_instance. Writes the same pre-instantiated ADD mix
+//   - unchecked, staged and committed into room reserved up front,
+//   - checked into a pre-faulted alloc_buf buffer,
+//   - checked into an alloc_buf_growable buffer that commits pages as the
+//     cursor advances.
+
+#define EMIT_INSTRS (2 * 1000 * 1000)
+#define EMIT_MIX 8
+
+int main(void) {
+    instr_instance_t mix[EMIT_MIX] = {
+        instruction_instantiate(ADD(EAX, arg_imm_32(0x12345))),
+        instruction_instantiate(ADD(RAX, RDX)),
+        instruction_instantiate(ADD(RCX, arg_imm_8(1))),
+        instruction_instantiate(ADD(arg_mem_64_auto(RSP, arg_reg_none, 0, 8), arg_imm_8(8))),
+        instruction_instantiate(ADD(R8, arg_mem_64_auto(RBX, arg_reg_none, 0, 0))),
+        instruction_instantiate(ADD(ECX, EDX)),
+        instruction_instantiate(ADD(DL, arg_imm_8(5))),
+        instruction_instantiate(ADD(arg_mem_32_auto(RDI, arg_reg_none, 0, 0), EAX)),
+    };
+    for (int i = 0; i < EMIT_MIX; i++) {
+        if (!instance_is_valid(mix[i])) {
+            printf("instance %d failed to instantiate\n", i);
+            return 1;
+        }
+    }
+
+    uint64_t size = (uint64_t) EMIT_INSTRS * STAGING_SIZE;
+    buffer_t plain = alloc_buf(size);
+    buffer_t growable = alloc_buf_growable(size, BUF_PAGE_SIZE);
+    if (!plain.data || !growable.data) {
+        printf("out of memory\n");
+        return 1;
+    }
+    memset(plain.data, 0, size);
+
+    double unchecked, checked, checked_growable;
+    bench_best(unchecked, EMIT_INSTRS, {
+        plain.cursor = 0;
+        buf_reserve(&plain, size);
+        for (int i = 0; i < EMIT_INSTRS; i++) {
+            staging_t stage = {0};
+            stage_instruction_instance(&stage, mix[i % EMIT_MIX]);
+            buf_commit(&plain, stage);
+        }
+        bench_keep(plain.cursor);
+    });
+    bench_best(checked, EMIT_INSTRS, {
+        plain.cursor = 0;
+        for (int i = 0; i < EMIT_INSTRS; i++) {
+            write_instruction_instance(&plain, mix[i % EMIT_MIX]);
+        }
+        bench_keep(plain.cursor);
+    });
+    bench_best(checked_growable, EMIT_INSTRS, {
+        growable.cursor = 0;
+        for (int i = 0; i < EMIT_INSTRS; i++) {
+            write_instruction_instance(&growable, mix[i % EMIT_MIX]);
+        }
+        bench_keep(growable.cursor);
+    });
+
+    printf("%d instructions, %lu bytes, best of %d runs\n",
+           EMIT_INSTRS, plain.cursor, BENCH_RUNS);
+    printf("unchecked          %6.2f ns/instr  %6.1f Minstr/s\n", unchecked, 1e3 / unchecked);
+    printf("checked            %6.2f ns/instr  %6.1f Minstr/s\n", checked, 1e3 / checked);
+    printf("checked, growable  %6.2f ns/instr  %6.1f Minstr/s\n", checked_growable, 1e3 / checked_growable);
+    return 0;
+}
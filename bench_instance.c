@@ -0,0 +1,85 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// Instance packing: instr_instance_t is kept at 16 bytes so it is passed
+// and returned in two registers. Instantiates and writes an 8-form ADD mix
+// through a noinline call that returns the instance, once as it is and
+// once wrapped in a 48 byte struct, the old instance size, which SysV
+// returns through a hidden memory slot. The inline row is the same loop
+// without any call.
+
+#define INSTANCE_INSTRS (4 * 1000 * 1000)
+#define INSTANCE_MIX 8
+
+typedef struct {
+    instr_instance_t instance;
+    uint8_t pad[32];
+} bench_wide_instance_t;
+
+__attribute__((noinline))
+static instr_instance_t bench_instantiate(instr_t instr) {
+    return instruction_instantiate(instr);
+}
+
+__attribute__((noinline))
+static bench_wide_instance_t bench_instantiate_wide(instr_t instr) {
+    return (bench_wide_instance_t) {.instance = instruction_instantiate(instr)};
+}
+
+int main(void) {
+    arg_t mix[INSTANCE_MIX][2] = {
+        {EAX, arg_imm_32(0x12345)},
+        {RAX, RDX},
+        {RCX, arg_imm_8(1)},
+        {arg_mem_64_auto(RSP, arg_reg_none, 0, 8), arg_imm_8(8)},
+        {R8, arg_mem_64_auto(RBX, arg_reg_none, 0, 0)},
+        {ECX, EDX},
+        {AL, arg_imm_8(1)},
+        {arg_mem_32_auto(RDI, arg_reg_none, 0, 0), EAX},
+    };
+    instr_t instrs[INSTANCE_MIX];
+    for (int i = 0; i < INSTANCE_MIX; i++) {
+        instrs[i] = (instr_t) {.op = OP_ADD, .args = mix[i], .len = 2};
+    }
+
+    buffer_t buf = alloc_buf((uint64_t) INSTANCE_INSTRS * STAGING_SIZE);
+    if (!buf.data) {
+        printf("out of memory\n");
+        return 1;
+    }
+    memset(buf.data, 0, buf.size);
+
+    double inlined, registers, memory;
+    bench_best(inlined, INSTANCE_INSTRS, {
+        buf.cursor = 0;
+        for (int i = 0; i < INSTANCE_INSTRS; i++) {
+            write_instruction_instance(&buf, instruction_instantiate(instrs[i % INSTANCE_MIX]));
+        }
+        bench_keep(buf.cursor);
+    });
+    bench_best(registers, INSTANCE_INSTRS, {
+        buf.cursor = 0;
+        for (int i = 0; i < INSTANCE_INSTRS; i++) {
+            write_instruction_instance(&buf, bench_instantiate(instrs[i % INSTANCE_MIX]));
+        }
+        bench_keep(buf.cursor);
+    });
+    bench_best(memory, INSTANCE_INSTRS, {
+        buf.cursor = 0;
+        for (int i = 0; i < INSTANCE_INSTRS; i++) {
+            write_instruction_instance(&buf, bench_instantiate_wide(instrs[i % INSTANCE_MIX]).instance);
+        }
+        bench_keep(buf.cursor);
+    });
+
+    printf("sizeof(instr_instance_t) %zu, wrapped %zu\n",
+           sizeof(instr_instance_t), sizeof(bench_wide_instance_t));
+    printf("instantiate+write, best of %d runs\n", BENCH_RUNS);
+    printf("inline                  %6.2f ns/instr\n", inlined);
+    printf("call, 16 byte return    %6.2f ns/instr\n", registers);
+    printf("call, 48 byte return    %6.2f ns/instr\n", memory);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// Copy bandwidth with cached and non-temporal stores. Generates a copy
+// loop that moves 128 bytes per iteration with 4 vmovdqu ymm loads and 4
+// stores, which are vmovdqu in one variant and vmovntdq followed by one
+// sfence in the other, and a third variant that also prefetches the
+// source with prefetchnta. Each variant copies buffers of growing size,
+// from one that fits in the caches to several that don't.
+
+#define MEMCPY_BLOCK 128
+#define MEMCPY_PREFETCH_DISTANCE 1024
+#define MEMCPY_VARIANTS 3
+
+#define MEMCPY_CACHED 0
+#define MEMCPY_NON_TEMPORAL 1
+#define MEMCPY_NON_TEMPORAL_PREFETCH 2
+
+static const char* memcpy_names[MEMCPY_VARIANTS] = {
+    [MEMCPY_CACHED] = "vmovdqu",
+    [MEMCPY_NON_TEMPORAL] = "vmovntdq",
+    [MEMCPY_NON_TEMPORAL_PREFETCH] = "vmovntdq + prefetchnta",
+};
+
+static const uint64_t memcpy_sizes_mib[] = {1, 16, 256, 1024};
+
+// copy(dst, src, bytes) for a non-zero multiple of MEMCPY_BLOCK bytes,
+// both buffers 32 byte aligned
+typedef void (*bench_copy_t)(uint8_t* dst, const uint8_t* src, uint64_t bytes);
+
+static bench_copy_t bench_copy(buffer_t* buf, int variant) {
+    labels_t labels = alloc_labels();
+    uint32_t top = label_new(&labels);
+    uint64_t start = buf->cursor;
+    bool ok = write_instruction_labels(buf, &labels, ALIGN(arg_imm_8(64))) &&
+              write_instruction_labels(buf, &labels, LABEL(arg_label(top)));
+    if (variant == MEMCPY_NON_TEMPORAL_PREFETCH) {
+        arg_t ahead = arg_mem_8_auto(RSI, arg_reg_none, 0, MEMCPY_PREFETCH_DISTANCE);
+        ok = ok && write_instruction_labels(buf, &labels, PREFETCHNTA(ahead));
+    }
+    for (int i = 0; i < 4 && ok; i++) {
+        arg_t src = arg_mem_256_auto(RSI, arg_reg_none, 0, 32 * i);
+        ok = write_instruction_labels(buf, &labels, VMOVDQU(arg_reg_ymm(i), src));
+    }
+    for (int i = 0; i < 4 && ok; i++) {
+        arg_t dst = arg_mem_256_auto(RDI, arg_reg_none, 0, 32 * i);
+        ok = write_instruction_labels(buf, &labels, variant == MEMCPY_CACHED
+            ? VMOVDQU(dst, arg_reg_ymm(i))
+            : VMOVNTDQ(dst, arg_reg_ymm(i)));
+    }
+    ok = ok &&
+         write_instruction_labels(buf, &labels, ADD(RSI, arg_imm_32(MEMCPY_BLOCK))) &&
+         write_instruction_labels(buf, &labels, ADD(RDI, arg_imm_32(MEMCPY_BLOCK))) &&
+         write_instruction_labels(buf, &labels, SUB(RDX, arg_imm_32(MEMCPY_BLOCK))) &&
+         write_instruction_labels(buf, &labels, JCC(arg_cond(COND_NE), arg_label(top)));
+    if (variant != MEMCPY_CACHED) {
+        ok = ok && write_instruction_labels(buf, &labels, SFENCE());
+    }
+    free_labels(&labels);
+    if (!ok || !buf_reserve(buf, 4)) {
+        return NULL;
+    }
+    // vzeroupper and ret
+    buf_write_8(buf, 0xc5);
+    buf_write_8(buf, 0xf8);
+    buf_write_8(buf, 0x77);
+    buf_write_8(buf, 0xc3);
+    return (bench_copy_t) buf_exec_addr(buf, start);
+}
+
+int main(void) {
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("this cpu has no AVX2\n");
+        return 1;
+    }
+
+    buffer_t buf = alloc_buf_exec(BUF_PAGE_SIZE);
+    bench_copy_t copies[MEMCPY_VARIANTS];
+    for (int v = 0; v < MEMCPY_VARIANTS; v++) {
+        copies[v] = bench_copy(&buf, v);
+        if (!copies[v]) {
+            printf("failed to write the copy loops\n");
+            return 1;
+        }
+    }
+
+    printf("copy bandwidth in GB/s, best of %d runs, single thread\n", BENCH_RUNS);
+    printf("   buffer");
+    for (int v = 0; v < MEMCPY_VARIANTS; v++) {
+        printf("  %24s", memcpy_names[v]);
+    }
+    printf("\n");
+
+    for (uint64_t s = 0; s < sizeof(memcpy_sizes_mib) / sizeof(memcpy_sizes_mib[0]); s++) {
+        uint64_t bytes = memcpy_sizes_mib[s] << 20;
+        uint8_t* src = mmap(0, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        uint8_t* dst = mmap(0, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (src == MAP_FAILED || dst == MAP_FAILED) {
+            printf("%5lu MiB  out of memory\n", memcpy_sizes_mib[s]);
+            break;
+        }
+        for (uint64_t i = 0; i < bytes; i++) {
+            src[i] = i * 31;
+        }
+
+        printf("%5lu MiB", memcpy_sizes_mib[s]);
+        for (int v = 0; v < MEMCPY_VARIANTS; v++) {
+            double ns;
+            memset(dst, 0, bytes);
+            bench_best(ns, bytes, copies[v](dst, src, bytes));
+            if (memcmp(src, dst, bytes)) {
+                printf("  the %s copy is wrong\n", memcpy_names[v]);
+                return 1;
+            }
+            printf("  %24.2f", 1 / ns);
+        }
+        printf("\n");
+        munmap(src, bytes);
+        munmap(dst, bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#define ASSEMBLER_NO_DEMO
+#include "assembler.c"
+#include "bench.h"
+
+////////////////////////////////////////////////////////////////
+
+// Nop padding: executes loops of back to back padding blocks from an
+// alloc_buf_exec code heap, padded either with the multi-byte nops
+// write_nop_instance emits or with the 0x66 chains in front of 0x90 it
+// used to emit, for every block length from 1 to 15 bytes.
+//
+// The small loop runs from the uop cache, where time tracks the number
+// of nops, so the 12 to 15 byte blocks that take two multi-byte nops but
+// one prefixed 0x90 are slower with the multi-byte nops. The large loop
+// doesn't fit in the uop cache and goes through the legacy decoders,
+// which is where a core with a prefix decode penalty shows one. Cores
+// without one, like the big Intel cores, run both schemes at the same
+// speed there.
+
+#define NOPS_SMALL_BLOCKS 64
+#define NOPS_LARGE_BLOCKS 4096
+#define NOPS_EXECUTED (20 * 1000 * 1000)
+
+// the old scheme, up to 14 0x66 prefixes per 15 byte chunk
+inline static void bench_pad_prefixed(buffer_t* buf, uint64_t len) {
+    while (len) {
+        uint64_t chunk = len > 15 ? 15 : len;
+        for (uint64_t i = 1; i < chunk; i++) {
+            buf_write_8(buf, 0x66);
+        }
+        buf_write_8(buf, 0x90);
+        len -= chunk;
+    }
+}
+
+typedef void (*bench_loop_t)(uint32_t iterations);
+
+// a loop over `blocks` padding blocks of len bytes, counting edi down to 0
+static bench_loop_t bench_nop_loop(buffer_t* buf,
+                                   labels_t* labels,
+                                   uint32_t  blocks,
+                                   uint8_t   len,
+                                   bool      prefixed) {
+    buf->cursor = 0;
+    labels_reset(labels);
+    uint32_t top = label_new(labels);
+    bool ok = write_instruction_labels(buf, labels, ALIGN(arg_imm_8(64))) &&
+              write_instruction_labels(buf, labels, LABEL(arg_label(top)));
+    for (uint32_t i = 0; i < blocks && ok; i++) {
+        if (prefixed) {
+            ok = buf_reserve(buf, STAGING_SIZE);
+            bench_pad_prefixed(buf, len);
+        }
+        else {
+            ok = write_instruction_labels(buf, labels, NOP(arg_imm_8(len)));
+        }
+    }
+    ok = ok &&
+         write_instruction_labels(buf, labels, SUB(EDI, arg_imm_8(1))) &&
+         write_instruction_labels(buf, labels, JCC(arg_cond(COND_NE), arg_label(top))) &&
+         buf_reserve(buf, 1);
+    if (!ok) {
+        return NULL;
+    }
+    buf_write_8(buf, 0xc3);
+    return (bench_loop_t) buf_exec_addr(buf, 0);
+}
+
+int main(void) {
+    buffer_t buf = alloc_buf_exec(1 << 20);
+    labels_t labels = alloc_labels();
+    uint32_t sizes[2] = {NOPS_SMALL_BLOCKS, NOPS_LARGE_BLOCKS};
+
+    printf("ns per padding block, best of %d runs\n", BENCH_RUNS);
+    for (int s = 0; s < 2; s++) {
+        uint32_t blocks = sizes[s];
+        uint32_t iterations = NOPS_EXECUTED / blocks;
+        printf("%u blocks per loop\n", blocks);
+        printf("  len   66..90  0f 1f    ratio\n");
+        for (uint8_t len = 1; len <= 15; len++) {
+            double ns[2];
+            for (int prefixed = 0; prefixed < 2; prefixed++) {
+                bench_loop_t loop = bench_nop_loop(&buf, &labels, blocks, len, prefixed);
+                if (!loop) {
+                    printf("failed to write the loop\n");
+                    return 1;
+                }
+                loop(1);
+                bench_best(ns[prefixed], (double) iterations * blocks, loop(iterations));
+            }
+            printf("  %3u   %6.3f  %6.3f   %5.2f\n", len, ns[1], ns[0], ns[0] / ns[1]);
+        }
+    }
+    return 0;
+}
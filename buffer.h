@@ -1,16 +1,41 @@
+// memfd_create and mremap are GNU extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <sys/mman.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
-//#include <unistd.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdbool.h>
 
 typedef struct {
     uint8_t* data;
     uint64_t size;
     uint64_t cursor;
+    uint64_t reserved;
+    uint8_t* exec;
 } buffer_t;
 
+// size is the writable part of the mapping. Buffers from alloc_buf_growable
+// additionally reserve `reserved` bytes of address space up front and commit
+// pages out of it as the cursor advances, so data never moves. Plain alloc_buf
+// buffers have reserved == 0 and try to grow in place with mremap instead.
+//
+// Buffers from alloc_buf_exec are code heaps: one memfd mapped twice, data is
+// the writable view the writers target and exec is a read/execute view of the
+// same pages, so finished code can run without any mprotect.
+//
+// The buf_write_* functions below never check capacity: callers reserve room
+// for a whole instruction with buf_reserve first and then write unchecked.
+
+#define BUF_PAGE_SIZE 4096
+
+#define buf_round_page(size) \
+    (((size) + BUF_PAGE_SIZE - 1) & ~((uint64_t) BUF_PAGE_SIZE - 1))
+
 inline static void buf_write_8(buffer_t* buf, uint8_t val) {
     //printf("%02hx", val);
     (buf)->data[(buf)->cursor++] = (val & 0xff);
@@ -31,6 +56,48 @@ inline static void buf_write_64(buffer_t* buf, uint64_t val) {
     buf_write_32(buf, (val) >> 32);
 }
 
+// overwrites 4 already written bytes, for fields filled in after the fact
+inline static void buf_patch_32(buffer_t* buf, uint64_t offset, uint32_t val) {
+    memcpy(buf->data + offset, &val, 4);
+}
+
+// Staging area for one encoded instruction. The bytes are accumulated in a
+// 128 bit integer so they live in registers while the instruction is built,
+// and buf_commit then stores all 16 bytes at once and bumps the cursor once.
+// This needs 16 bytes of room at the cursor even for shorter instructions.
+
+typedef struct {
+    unsigned __int128 bytes;
+    uint8_t len;
+} staging_t;
+
+#define STAGING_SIZE 16
+
+inline static void stage_write_8(staging_t* stage, uint8_t val) {
+    stage->bytes |= (unsigned __int128) val << (stage->len * 8);
+    stage->len += 1;
+}
+
+inline static void stage_write_16(staging_t* stage, uint16_t val) {
+    stage->bytes |= (unsigned __int128) val << (stage->len * 8);
+    stage->len += 2;
+}
+
+inline static void stage_write_32(staging_t* stage, uint32_t val) {
+    stage->bytes |= (unsigned __int128) val << (stage->len * 8);
+    stage->len += 4;
+}
+
+inline static void stage_write_64(staging_t* stage, uint64_t val) {
+    stage->bytes |= (unsigned __int128) val << (stage->len * 8);
+    stage->len += 8;
+}
+
+inline static void buf_commit(buffer_t* buf, staging_t stage) {
+    memcpy(buf->data + buf->cursor, &stage.bytes, STAGING_SIZE);
+    buf->cursor += stage.len;
+}
+
 static inline buffer_t alloc_buf(uint64_t size) {
     uint8_t* data = mmap(
         0, size,
@@ -38,12 +105,142 @@ static inline buffer_t alloc_buf(uint64_t size) {
         MAP_PRIVATE | MAP_ANONYMOUS,
         -1, 0
     );
+    if (data == MAP_FAILED) {
+        return (buffer_t) {0};
+    }
     return (buffer_t) {
         .data = data,
         .size = size
     };
 }
 
+static inline buffer_t alloc_buf_growable(uint64_t reserve, uint64_t size) {
+    reserve = buf_round_page(reserve);
+    size = buf_round_page(size);
+    if (size > reserve) {
+        return (buffer_t) {0};
+    }
+    uint8_t* data = mmap(
+        0, reserve,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0
+    );
+    if (data == MAP_FAILED) {
+        return (buffer_t) {0};
+    }
+    if (size && mprotect(data, size, PROT_READ | PROT_WRITE)) {
+        munmap(data, reserve);
+        return (buffer_t) {0};
+    }
+    return (buffer_t) {
+        .data = data,
+        .size = size,
+        .reserved = reserve
+    };
+}
+
+static inline buffer_t alloc_buf_exec(uint64_t size) {
+    size = buf_round_page(size);
+    int fd = memfd_create("sasm-code", MFD_CLOEXEC);
+    if (fd < 0) {
+        return (buffer_t) {0};
+    }
+    // the file is sparse, pages are only allocated once written
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return (buffer_t) {0};
+    }
+    uint8_t* data = mmap(
+        0, size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_NORESERVE,
+        fd, 0
+    );
+    uint8_t* exec = mmap(
+        0, size,
+        PROT_READ | PROT_EXEC,
+        MAP_SHARED | MAP_NORESERVE,
+        fd, 0
+    );
+    close(fd);
+    if (data == MAP_FAILED || exec == MAP_FAILED) {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+        if (exec != MAP_FAILED) {
+            munmap(exec, size);
+        }
+        return (buffer_t) {0};
+    }
+    return (buffer_t) {
+        .data = data,
+        .size = size,
+        .reserved = size,
+        .exec = exec
+    };
+}
+
+static inline void free_buf(buffer_t* buf) {
+    uint64_t mapped = buf->reserved ? buf->reserved : buf->size;
+    if (buf->data) {
+        munmap(buf->data, mapped);
+    }
+    if (buf->exec) {
+        munmap(buf->exec, mapped);
+    }
+    *buf = (buffer_t) {0};
+}
+
+// executable address of the code at offset, NULL for non-code buffers
+inline static void* buf_exec_addr(buffer_t* buf, uint64_t offset) {
+    if (!buf->exec) {
+        return NULL;
+    }
+    return buf->exec + offset;
+}
+
+__attribute__((noinline, cold))
+static bool buf_grow(buffer_t* buf, uint64_t len) {
+    uint64_t needed = buf->cursor + len;
+    uint64_t new_size = buf->size * 2;
+    if (new_size < needed) {
+        new_size = needed;
+    }
+    new_size = buf_round_page(new_size);
+
+    if (buf->reserved) {
+        if (needed > buf->reserved) {
+            return false;
+        }
+        if (new_size > buf->reserved) {
+            new_size = buf->reserved;
+        }
+        if (mprotect(buf->data + buf->size,
+                     new_size - buf->size,
+                     PROT_READ | PROT_WRITE)) {
+            return false;
+        }
+    }
+    else {
+        // without MREMAP_MAYMOVE this either extends the mapping where it
+        // is or fails, so pointers into data stay valid either way
+        if (mremap(buf->data, buf->size, new_size, 0) == MAP_FAILED) {
+            return false;
+        }
+    }
+    buf->size = new_size;
+    return true;
+}
+
+// makes sure len more bytes fit at the cursor, growing the buffer if needed
+inline static bool buf_reserve(buffer_t* buf, uint64_t len) {
+    if (__builtin_expect(buf->cursor + len <= buf->size, true)) {
+        return true;
+    }
+    return buf_grow(buf, len);
+}
+
 static inline void buf_hexdump(buffer_t buf) {
     for (int i = 0; i < buf.size; i += 16) {
         uint8_t row_nonzero = 0;
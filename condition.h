@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////
+
+// Condition codes as they appear in the low nibble of the Jcc, SETcc and
+// CMOVcc opcodes.
+
+#define COND_O   0x0
+#define COND_NO  0x1
+#define COND_B   0x2
+#define COND_AE  0x3
+#define COND_E   0x4
+#define COND_NE  0x5
+#define COND_BE  0x6
+#define COND_A   0x7
+#define COND_S   0x8
+#define COND_NS  0x9
+#define COND_P   0xa
+#define COND_NP  0xb
+#define COND_L   0xc
+#define COND_GE  0xd
+#define COND_LE  0xe
+#define COND_G   0xf
+
+#define COND_C   COND_B
+#define COND_NAE COND_B
+#define COND_NB  COND_AE
+#define COND_NC  COND_AE
+#define COND_Z   COND_E
+#define COND_NZ  COND_NE
+#define COND_NA  COND_BE
+#define COND_NBE COND_A
+#define COND_PE  COND_P
+#define COND_PO  COND_NP
+#define COND_NGE COND_L
+#define COND_NL  COND_GE
+#define COND_NG  COND_LE
+#define COND_NLE COND_G
+
+// the condition with the opposite outcome
+#define cond_invert(cond) ((cond) ^ 1)
+
+////////////////////////////////////////////////////////////////
+
+inline static void print_cond(uint8_t cond) {
+    static const char* names[] = {
+        "O", "NO", "B", "AE", "E", "NE", "BE", "A",
+        "S", "NS", "P", "NP", "L", "GE", "LE", "G"
+    };
+    if (cond > COND_G) {
+        printf("cond(BAD)");
+        return;
+    }
+    printf("cond(%s)", names[cond]);
+}
@@ -7,9 +7,43 @@ typedef struct {
     uint8_t size;
 } immediate_t;
 
+// Immediates as stored inside arg_t, the size lives in the arg_t header.
+// 64 bit values that don't sign extend from 32 bits live in the arg_wide
+// pool and data holds their slot.
+typedef struct __attribute__((packed)) {
+    uint32_t data;
+    uint8_t wide : 1;
+} packed_immediate_t;
+
 #define immediate_data(imm) ((imm).data)
 #define immediate_size(imm) ((imm).size)
 
+// the value sign extended from its declared size, which is how the cpu
+// widens immediates that are narrower than the operation
+inline static int64_t immediate_signed(immediate_t imm) {
+    switch (immediate_size(imm)) {
+    case ARG_SIZE_8:  return (int8_t)  immediate_data(imm);
+    case ARG_SIZE_16: return (int16_t) immediate_data(imm);
+    case ARG_SIZE_32: return (int32_t) immediate_data(imm);
+    default:          return (int64_t) immediate_data(imm);
+    }
+}
+
+// smallest immediate size that sign extends back to the same value
+inline static uint8_t immediate_min_size(immediate_t imm) {
+    int64_t value = immediate_signed(imm);
+    if (value == (int8_t) value) {
+        return ARG_SIZE_8;
+    }
+    if (value == (int16_t) value) {
+        return ARG_SIZE_16;
+    }
+    if (value == (int32_t) value) {
+        return ARG_SIZE_32;
+    }
+    return ARG_SIZE_64;
+}
+
 inline static void print_imm(immediate_t imm) {
     switch (immediate_size(imm)) {
     case ARG_SIZE_8:
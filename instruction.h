@@ -4,25 +4,212 @@
 
 ////////////////////////////////////////////////////////////////
 
-typedef enum {OP_ADD, OP_NOP} op_t;
+typedef enum {
+    OP_ADD, OP_NOP, OP_JMP, OP_JCC, OP_CALL, OP_LABEL, OP_ALIGN,
+
+    // condition code families, with the condition as the first operand
+    // like OP_JCC
+    OP_SETCC, OP_CMOVCC,
+
+    // group 1, 2 and 3 ALU ops
+    OP_OR, OP_ADC, OP_SBB, OP_AND, OP_SUB, OP_XOR, OP_CMP,
+    OP_ROL, OP_ROR, OP_RCL, OP_RCR, OP_SHL, OP_SHR, OP_SAR,
+    OP_NOT, OP_NEG, OP_MUL, OP_IMUL, OP_DIV, OP_IDIV, OP_TEST,
+
+    // moves
+    OP_MOV, OP_MOVZX, OP_MOVSX,
+
+    // read-modify-write ops for atomics, LOCK makes them atomic on a memory
+    // destination (xchg with memory is locked either way)
+    OP_INC, OP_DEC, OP_XCHG, OP_XADD, OP_CMPXCHG, OP_CMPXCHG8B, OP_CMPXCHG16B,
+
+    // non-temporal stores, the fence that orders them and prefetch hints
+    OP_MOVNTI, OP_MOVNTDQ, OP_SFENCE,
+    OP_PREFETCHT0, OP_PREFETCHT1, OP_PREFETCHT2, OP_PREFETCHNTA, OP_PREFETCHW,
+
+    // mandatory prefix legacy ops
+    OP_POPCNT, OP_LZCNT, OP_TZCNT, OP_CRC32,
+    OP_PMULLD, OP_PMINSD, OP_PMAXSD, OP_PMINUD, OP_PMAXUD,
+    OP_PCMPEQQ, OP_PCMPGTQ, OP_PTEST,
+    OP_PEXTRD, OP_PEXTRQ, OP_PINSRD, OP_PINSRQ,
+
+    // AVX/AVX2
+    OP_VPADDD, OP_VPADDQ, OP_VPAND, OP_VPXOR, OP_VMOVDQU, OP_VMOVNTDQ,
+    OP_VPBROADCASTB, OP_VPBROADCASTW, OP_VPBROADCASTD, OP_VPBROADCASTQ,
+    OP_VPERMD,
+    OP_VFMADD132PS, OP_VFMADD213PS, OP_VFMADD231PS,
+    OP_VFMADD132PD, OP_VFMADD213PD, OP_VFMADD231PD,
+
+    // BMI1/BMI2, VEX encoded general purpose ops
+    OP_SHLX, OP_SARX, OP_SHRX, OP_RORX, OP_BZHI, OP_PDEP, OP_PEXT,
+    OP_ANDN, OP_BLSR, OP_MULX,
+
+    // AVX-512
+    OP_VPANDD, OP_VPANDQ, OP_VPXORD, OP_VPXORQ, OP_VMOVDQU32, OP_VMOVDQU64,
+    OP_VPCMPEQD, OP_VPCMPGTD,
+    OP_VPCOMPRESSD, OP_VPCOMPRESSQ, OP_VPEXPANDD, OP_VPEXPANDQ,
+    OP_KMOVW,
+
+    NUM_OPS
+} op_t;
 
 typedef struct {
     arg_t* args;
     op_t op;
     uint8_t len;
+    bool lock;
+    // see apply_lcp_policy
+    bool widen;
 } instr_t;
 
 ////////////////////////////////////////////////////////////////
 
+static const char* op_names[NUM_OPS] = {
+    [OP_ADD] = "add",
+    [OP_NOP] = "nop",
+    [OP_JMP] = "jmp",
+    [OP_JCC] = "jcc",
+    [OP_CALL] = "call",
+    [OP_LABEL] = "label",
+    [OP_ALIGN] = "align",
+    [OP_SETCC] = "setcc",
+    [OP_CMOVCC] = "cmovcc",
+    [OP_OR] = "or",
+    [OP_ADC] = "adc",
+    [OP_SBB] = "sbb",
+    [OP_AND] = "and",
+    [OP_SUB] = "sub",
+    [OP_XOR] = "xor",
+    [OP_CMP] = "cmp",
+    [OP_ROL] = "rol",
+    [OP_ROR] = "ror",
+    [OP_RCL] = "rcl",
+    [OP_RCR] = "rcr",
+    [OP_SHL] = "shl",
+    [OP_SHR] = "shr",
+    [OP_SAR] = "sar",
+    [OP_NOT] = "not",
+    [OP_NEG] = "neg",
+    [OP_MUL] = "mul",
+    [OP_IMUL] = "imul",
+    [OP_DIV] = "div",
+    [OP_IDIV] = "idiv",
+    [OP_TEST] = "test",
+    [OP_MOV] = "mov",
+    [OP_MOVZX] = "movzx",
+    [OP_MOVSX] = "movsx",
+    [OP_INC] = "inc",
+    [OP_DEC] = "dec",
+    [OP_XCHG] = "xchg",
+    [OP_XADD] = "xadd",
+    [OP_CMPXCHG] = "cmpxchg",
+    [OP_CMPXCHG8B] = "cmpxchg8b",
+    [OP_CMPXCHG16B] = "cmpxchg16b",
+    [OP_MOVNTI] = "movnti",
+    [OP_MOVNTDQ] = "movntdq",
+    [OP_SFENCE] = "sfence",
+    [OP_PREFETCHT0] = "prefetcht0",
+    [OP_PREFETCHT1] = "prefetcht1",
+    [OP_PREFETCHT2] = "prefetcht2",
+    [OP_PREFETCHNTA] = "prefetchnta",
+    [OP_PREFETCHW] = "prefetchw",
+    [OP_POPCNT] = "popcnt",
+    [OP_LZCNT] = "lzcnt",
+    [OP_TZCNT] = "tzcnt",
+    [OP_CRC32] = "crc32",
+    [OP_PMULLD] = "pmulld",
+    [OP_PMINSD] = "pminsd",
+    [OP_PMAXSD] = "pmaxsd",
+    [OP_PMINUD] = "pminud",
+    [OP_PMAXUD] = "pmaxud",
+    [OP_PCMPEQQ] = "pcmpeqq",
+    [OP_PCMPGTQ] = "pcmpgtq",
+    [OP_PTEST] = "ptest",
+    [OP_PEXTRD] = "pextrd",
+    [OP_PEXTRQ] = "pextrq",
+    [OP_PINSRD] = "pinsrd",
+    [OP_PINSRQ] = "pinsrq",
+    [OP_VPADDD] = "vpaddd",
+    [OP_VPADDQ] = "vpaddq",
+    [OP_VPAND] = "vpand",
+    [OP_VPXOR] = "vpxor",
+    [OP_VMOVDQU] = "vmovdqu",
+    [OP_VMOVNTDQ] = "vmovntdq",
+    [OP_VPBROADCASTB] = "vpbroadcastb",
+    [OP_VPBROADCASTW] = "vpbroadcastw",
+    [OP_VPBROADCASTD] = "vpbroadcastd",
+    [OP_VPBROADCASTQ] = "vpbroadcastq",
+    [OP_VPERMD] = "vpermd",
+    [OP_VFMADD132PS] = "vfmadd132ps",
+    [OP_VFMADD213PS] = "vfmadd213ps",
+    [OP_VFMADD231PS] = "vfmadd231ps",
+    [OP_VFMADD132PD] = "vfmadd132pd",
+    [OP_VFMADD213PD] = "vfmadd213pd",
+    [OP_VFMADD231PD] = "vfmadd231pd",
+    [OP_SHLX] = "shlx",
+    [OP_SARX] = "sarx",
+    [OP_SHRX] = "shrx",
+    [OP_RORX] = "rorx",
+    [OP_BZHI] = "bzhi",
+    [OP_PDEP] = "pdep",
+    [OP_PEXT] = "pext",
+    [OP_ANDN] = "andn",
+    [OP_BLSR] = "blsr",
+    [OP_MULX] = "mulx",
+    [OP_VPANDD] = "vpandd",
+    [OP_VPANDQ] = "vpandq",
+    [OP_VPXORD] = "vpxord",
+    [OP_VPXORQ] = "vpxorq",
+    [OP_VMOVDQU32] = "vmovdqu32",
+    [OP_VMOVDQU64] = "vmovdqu64",
+    [OP_VPCMPEQD] = "vpcmpeqd",
+    [OP_VPCMPGTD] = "vpcmpgtd",
+    [OP_VPCOMPRESSD] = "vpcompressd",
+    [OP_VPCOMPRESSQ] = "vpcompressq",
+    [OP_VPEXPANDD] = "vpexpandd",
+    [OP_VPEXPANDQ] = "vpexpandq",
+    [OP_KMOVW] = "kmovw",
+};
+
+// The ops that accept a LOCK prefix, always with a memory destination.
+// cmp and test only read their destination and can't be locked.
+static const bool op_lockable[NUM_OPS] = {
+    [OP_ADD] = true,
+    [OP_OR] = true,
+    [OP_ADC] = true,
+    [OP_SBB] = true,
+    [OP_AND] = true,
+    [OP_SUB] = true,
+    [OP_XOR] = true,
+    [OP_NOT] = true,
+    [OP_NEG] = true,
+    [OP_INC] = true,
+    [OP_DEC] = true,
+    [OP_XCHG] = true,
+    [OP_XADD] = true,
+    [OP_CMPXCHG] = true,
+    [OP_CMPXCHG8B] = true,
+    [OP_CMPXCHG16B] = true,
+};
+
+static inline instr_t instr_lock(instr_t instr) {
+    instr.lock = true;
+    return instr;
+}
+
+static inline instr_t instr_widen(instr_t instr) {
+    instr.widen = true;
+    return instr;
+}
+
 inline static void print_instr(instr_t instr) {
-    switch (instr.op) {
-    case OP_NOP:
-        printf("nop(");
-        break;
-    case OP_ADD:
-        printf("add(");
-        break;
+    if (instr.lock) {
+        printf("lock ");
+    }
+    if (instr.widen) {
+        printf("widen ");
     }
+    printf("%s(", instr.op < NUM_OPS && op_names[instr.op] ? op_names[instr.op] : "BAD");
     for (int i = 0; i < instr.len; i++) {
         if (i != 0) {
             printf(", ");
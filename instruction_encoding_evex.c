@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////
+
+static inline instr_instance_t add_args_memory_evex(instr_instance_t instance,
+                                                    memory_t         mem,
+                                                    uint8_t          disp8_n);
+
+////////////////////////////////////////////////////////////////
+
+// Vector ops can have VEX and EVEX schemata. lookup_schema only picks an
+// EVEX schema when the instruction needs one, that is when it has a write
+// mask or a register beyond 15, or when no VEX schema takes the operands,
+// as with zmm registers or broadcasts.
+static inline instr_instance_t instantiate_evex(instr_t         instr,
+                                                instr_schema_t* schema,
+                                                arg_t           mask);
+
+static inline instr_instance_t instantiate_vector(instr_t instr) {
+    instr_schema_t* schema = lookup_schema(instr);
+    if (!schema) {
+        return instr_instantiation_error;
+    }
+    if (!schema->evex) {
+        return instantiate_vex(instr, schema);
+    }
+
+    arg_t mask = arg_none;
+    if (instr.len && arg_is_mask(instr.args[instr.len - 1])) {
+        mask = instr.args[--instr.len];
+    }
+    return instantiate_evex(instr, schema, mask);
+}
+
+////////////////////////////////////////////////////////////////
+
+// Like instantiate_vex, with one more bit for every register id, the write
+// mask and the vector length in L'L. A memory operand in the ARG_ROLE_BCST
+// role is a single element broadcast to the whole vector.
+static inline instr_instance_t instantiate_evex(instr_t         instr,
+                                                instr_schema_t* schema,
+                                                arg_t           mask) {
+    if (!schema || !schema->evex || schema->len != instr.len) {
+        return instr_instantiation_error;
+    }
+
+    instr_instance_t instance = {0};
+
+    if (!instance_set_opcode(&instance, schema->opcode) ||
+        opcode_map(instance) == OPCODE_MAP_NONE) {
+        return instr_instantiation_error;
+    }
+    instance_type(instance) = INSTR_TYPE_EVEX;
+    prefix_evex_implicit(instance) = schema->prefix;
+    prefix_flag_w(instance) = schema->w;
+    prefix_evex_size(instance) = schema->l;
+
+    if (arg_is_mask(mask)) {
+        opmask_t opmask = arg_to_mask(mask);
+        // zeroing needs a mask and doesn't apply to stores
+        if (opmask.zeroing && (!opmask.id || arg_is_mem(instr.args[0]))) {
+            return instr_instantiation_error;
+        }
+        prefix_evex_mask(instance) = opmask.id;
+        prefix_evex_zeroing(instance) = opmask.zeroing;
+    }
+
+    uint8_t reg_id = schema->digit;
+
+    for (int i = 0; i < schema->len; i++) {
+        arg_t arg = instr.args[i];
+        arg_info_t arg_info = schema->args_info[i];
+        switch (arg_info_role(arg_info)) {
+        case ARG_ROLE_REG:
+            if (!arg_is_reg(arg)) {
+                return instr_instantiation_error;
+            }
+            has_modrm(instance) = true;
+            reg_id = register_id_low(arg_to_reg(arg));
+            prefix_flag_r(instance) = register_id_high(arg_to_reg(arg)) != 0;
+            prefix_evex_flag_r2(instance) = register_id_ext(arg_to_reg(arg)) != 0;
+            break;
+        case ARG_ROLE_VVVV:
+            if (!arg_is_reg(arg)) {
+                return instr_instantiation_error;
+            }
+            prefix_vex_op_2(instance) = register_id(arg_to_reg(arg)) & 0xf;
+            prefix_evex_flag_v2(instance) = register_id_ext(arg_to_reg(arg)) != 0;
+            break;
+        case ARG_ROLE_RM:
+        case ARG_ROLE_BCST:
+            if (arg_is_mem(arg)) {
+                // disp8 is scaled by the bytes the instruction reads, which
+                // is the memory operand unless the schema says otherwise
+                uint8_t disp8_n = schema->disp8_elem
+                    ? (schema->w ? 8 : 4)
+                    : arg_size_bytes(arg_size(arg));
+                instance = add_args_memory_evex(instance, arg_to_mem(arg), disp8_n);
+                if (instance_is_invalid(instance)) {
+                    return instr_instantiation_error;
+                }
+                prefix_evex_broadcast(instance) = arg_info_role(arg_info) == ARG_ROLE_BCST;
+                break;
+            }
+            if (!arg_is_reg(arg) || arg_info_role(arg_info) == ARG_ROLE_BCST) {
+                return instr_instantiation_error;
+            }
+            has_modrm(instance) = true;
+            instance.modrm = make_modrm(MOD_DIRECT, 0, register_id_low(arg_to_reg(arg)));
+            prefix_flag_b(instance) = register_id_high(arg_to_reg(arg)) != 0;
+            prefix_flag_x(instance) = register_id_ext(arg_to_reg(arg)) != 0;
+            break;
+        case ARG_ROLE_IMM:
+            if (!arg_is_imm(arg)) {
+                return instr_instantiation_error;
+            }
+            imm_size(instance) = arg_info_size(arg_info);
+            instance.imm = immediate_signed(arg_to_imm(arg));
+            break;
+        default:
+            return instr_instantiation_error;
+        }
+    }
+
+    instance.modrm.reg = reg_id;
+    return instance;
+}
+
+////////////////////////////////////////////////////////////////
+
+// EVEX disp8 is implicitly multiplied by disp8_n, so a displacement gets
+// the one byte form when it is a multiple of disp8_n and the quotient fits
+// in 8 bits. An explicit ARG_SIZE_8 displacement has to compress.
+static inline instr_instance_t add_args_memory_evex(instr_instance_t instance,
+                                                    memory_t         mem,
+                                                    uint8_t          disp8_n) {
+    int64_t disp = memory_disp(mem);
+    uint8_t disp_size = memory_disp_size(mem);
+    uint8_t picked = memory_pick_disp_size(mem);
+    bool has_base = !register_is_none(memory_base(mem)) && !register_is_ip(memory_base(mem));
+    bool compress = disp_size == MEMORY_DISP_AUTO ? picked != ARG_SIZE_NONE
+                                                  : disp_size == ARG_SIZE_8;
+
+    if (has_base && compress && disp8_n) {
+        int64_t disp_8 = disp / disp8_n;
+        if (disp % disp8_n == 0 && disp_8 == (int8_t) disp_8) {
+            memory_disp(mem) = disp_8;
+            memory_disp_size(mem) = ARG_SIZE_8;
+        }
+        else if (disp_size == ARG_SIZE_8) {
+            return instr_instantiation_error;
+        }
+        else {
+            memory_disp_size(mem) = picked == ARG_SIZE_8 ? ARG_SIZE_32 : picked;
+        }
+    }
+
+    return add_args_memory_vex(instance, mem);
+}
@@ -4,220 +4,235 @@
 
 ////////////////////////////////////////////////////////////////
 
-static inline instr_instance_t add_sizes_legacy(instr_instance_t instance,
-                                                instr_t          instr);
-
-static inline instr_instance_t add_args_legacy(instr_instance_t instance,
-                                               arg_t            dest,
-                                               arg_t            src);
-
 static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
-                                                      memory_t         mem,
-                                                      arg_t            arg);
+                                                      memory_t         mem);
 
 ////////////////////////////////////////////////////////////////
 
-static inline instr_instance_t instantiate_legacy(instr_t          instr,
-                                                  instr_schemata_t schemata) {
-
-    uint32_t match_id = match_schema(schemata, instr);
-    if (match_id == -1) {
-        return instr_instantiation_error;
+// Length changing prefix policy. Immediates that fit in 8 bits already get
+// the sign extended imm8 forms, which carry no LCP. A widened instruction
+// (instr_widen) that is a 16 bit register operation with an imm16 is
+// encoded as the 32 bit operation on the same register instead. The low 16
+// bits of the result are the same, but a 32 bit write zero extends, so
+// bits 16 to 63 of the destination are lost. Only widen when all of them
+// and the flags the instruction sets are dead. lcp_policy.count counts the
+// instances that still carry an LCP. Thread local like instr_error.
+
+typedef struct {
+    uint64_t count;
+} lcp_policy_t;
+
+static _Thread_local lcp_policy_t lcp_policy;
+
+// cmp and test with an imm16 only produce flags, which depend on the upper
+// 16 bits once widened
+static inline bool instance_is_compare_imm(instr_instance_t instance) {
+    if (opcode_map(instance) != OPCODE_MAP_NONE) {
+        return false;
     }
+    switch (instance.opcode) {
+    case 0x3d: case 0xa9:
+        return true;
+    case 0x81:
+        return instance.modrm.reg == 7;
+    case 0xf7:
+        return instance.modrm.reg == 0;
+    }
+    return false;
+}
 
-    instr_schema_t match = schemata.schemata[match_id];
-
-    instr_instance_t instance = {0};
+static inline instr_instance_t apply_lcp_policy(instr_instance_t instance,
+                                                bool             widen) {
+    if (!instance_has_lcp(instance)) {
+        return instance;
+    }
+    bool reg_dest = !has_modrm(instance) || instance.modrm.mod == MOD_DIRECT;
+    if (widen && reg_dest && !instance_is_compare_imm(instance)) {
+        // instance.imm already holds the value sign extended to 32 bits
+        opsize_override(instance) = 0;
+        imm_size(instance) = ARG_SIZE_32;
+        return instance;
+    }
+    lcp_policy.count++;
+    return instance;
+}
 
-    instance.opcode = match.opcode;
-    instance_type(instance) = INSTR_TYPE_LEGACY;
+////////////////////////////////////////////////////////////////
 
-    instance = add_sizes_legacy(instance, instr);
-    if (instance_is_invalid(instance)) {
+// Operand sizes only matter for matching, the schema spells out the
+// prefixes. The mandatory prefix lands in the prefix group it shares its
+// byte with.
+static inline instr_instance_t instantiate_legacy(instr_t         instr,
+                                                  instr_schema_t* schema) {
+    if (!schema || schema->len != instr.len) {
         return instr_instantiation_error;
     }
 
-    arg_t dest = arg_none;
-    arg_t src = arg_none;
+    instr_instance_t instance = {0};
 
-    switch (instr.len) {
-    case 3:
-        if (!arg_is_imm(instr.args[2])) {
-            return instr_instantiation_error;
-        }
-        immediate_t imm = arg_to_imm(src);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-    case 2:
-        if (arg_info_id(match.args_info[1]) == (uint8_t) -1) {
-            src = instr.args[1];
-        }
-    case 1:
-        if (arg_info_id(match.args_info[0]) == (uint8_t) -1) {
-            dest = instr.args[0];
-        }
-    case 0:
-        break;
-    default:
+    if (!instance_set_opcode(&instance, schema->opcode)) {
         return instr_instantiation_error;
     }
+    instance_type(instance) = INSTR_TYPE_LEGACY;
 
-    return add_args_legacy(instance, dest, src);
-}
-
-////////////////////////////////////////////////////////////////
+    switch (schema->prefix) {
+    case PREFIX_MANDATORY_66:
+        opsize_override(instance) = true;
+        break;
+    case PREFIX_MANDATORY_F3:
+        prefix_group_1(instance) = PREFIX_REPZ;
+        break;
+    case PREFIX_MANDATORY_F2:
+        prefix_group_1(instance) = PREFIX_REPNZ;
+        break;
+    }
+    if (schema->opsize) {
+        opsize_override(instance) = true;
+    }
+    if (schema->w) {
+        prefix_flag_w(instance) = true;
+        prefix_has_rex(instance) = true;
+    }
 
-static inline instr_instance_t add_sizes_legacy(instr_instance_t instance,
-                                                instr_t          instr) {
-    uint8_t op_size = ARG_SIZE_NONE;
-    uint8_t addr_size = ARG_SIZE_NONE;
+    // modrm.rm is filled in by whichever operand comes first, so the reg
+    // field is only merged in at the end
+    uint8_t reg_id = schema->digit;
+    bool high_8 = false;
 
-    for (int i = 0; i < instr.len; i++) {
+    for (int i = 0; i < schema->len; i++) {
         arg_t arg = instr.args[i];
-        if (arg_is_mem(arg)) {
-            if (addr_size == ARG_SIZE_NONE) {
-                addr_size = arg_size(arg);
+        arg_info_t arg_info = schema->args_info[i];
+        register_t reg = arg_to_reg(arg);
+        switch (arg_info_role(arg_info)) {
+        case ARG_ROLE_REG:
+            if (!arg_is_reg(arg)) {
+                return instr_instantiation_error;
+            }
+            has_modrm(instance) = true;
+            reg_id = register_id_low(reg);
+            if (register_id_high(reg)) {
+                prefix_flag_r(instance) = true;
+                prefix_has_rex(instance) = true;
             }
-            else {
+            break;
+        case ARG_ROLE_RM:
+            if (arg_is_mem(arg)) {
+                memory_t mem = arg_to_mem(arg);
+                if (register_is_32(memory_base(mem)) ||
+                    register_is_32_ip(memory_base(mem)) ||
+                    register_is_32(memory_index(mem))) {
+                    addrsize_override(instance) = true;
+                }
+                instance = add_args_memory_legacy(instance, mem);
+                if (instance_is_invalid(instance)) {
+                    return instr_instantiation_error;
+                }
+                break;
+            }
+            if (!arg_is_reg(arg)) {
                 return instr_instantiation_error;
             }
-        }
-        if (arg_is_reg(arg)) {
-            if (op_size == ARG_SIZE_NONE) {
-                op_size = arg_size(arg);
+            has_modrm(instance) = true;
+            instance.modrm = make_modrm(MOD_DIRECT, 0, register_id_low(reg));
+            if (register_id_high(reg)) {
+                prefix_flag_b(instance) = true;
+                prefix_has_rex(instance) = true;
             }
-            else {
+            break;
+        case ARG_ROLE_IMM:
+            if (!arg_is_imm(arg)) {
                 return instr_instantiation_error;
             }
+            imm_size(instance) = arg_info_size(arg_info);
+            instance_set_imm(&instance, immediate_signed(arg_to_imm(arg)));
+            continue;
+        case ARG_ROLE_FIXED:
+            continue;
+        case ARG_ROLE_COND:
+            if (!arg_is_cond(arg)) {
+                return instr_instantiation_error;
+            }
+            instance.opcode |= arg_to_cond(arg);
+            continue;
+        case ARG_ROLE_OPCODE:
+            if (!arg_is_reg(arg)) {
+                return instr_instantiation_error;
+            }
+            instance.opcode |= register_id_low(reg);
+            if (register_id_high(reg)) {
+                prefix_flag_b(instance) = true;
+                prefix_has_rex(instance) = true;
+            }
+            break;
+        default:
+            return instr_instantiation_error;
         }
+        // spl, bpl, sil and dil need a REX prefix, ah, ch, dh and bh can't
+        // have one
+        if (arg_is_reg(arg) && register_is_8_rex(reg)) {
+            prefix_has_rex(instance) = true;
+        }
+        high_8 |= arg_is_reg(arg) && register_is_8_no_rex(reg);
     }
-
-    switch (addr_size) {
-    case ARG_SIZE_NONE:
-        break;
-    case ARG_SIZE_8:
-    case ARG_SIZE_16:
+    if (high_8 && prefix_has_rex(instance)) {
         return instr_instantiation_error;
-    case ARG_SIZE_32:
-        addrsize_override(instance) = true;
-        break;
-    case ARG_SIZE_64:
-        break;
     }
 
-    switch (op_size) {
-    case ARG_SIZE_NONE:
-    case ARG_SIZE_8:
-        break;
-    case ARG_SIZE_16:
-        opsize_override(instance) = true;
-    case ARG_SIZE_32:
-        break;
-    case ARG_SIZE_64:
-        prefix_flag_w(instance) = true;
-        prefix_has_rex(instance) = true;
-        break;
-    }
-
-    return instance;
+    instance.modrm.reg = reg_id;
+    return apply_lcp_policy(instance, instr.widen);
 }
 
 ////////////////////////////////////////////////////////////////
 
-static inline instr_instance_t add_args_legacy(instr_instance_t instance,
-                                               arg_t            dest,
-                                               arg_t            src) {
-    if (arg_is_mem(dest)) {
-        return add_args_memory_legacy(instance, arg_to_mem(dest), src);
-    }
-    if (arg_is_mem(src)) {
-        return add_args_memory_legacy(instance, arg_to_mem(src), dest);
-    }
-
-    if (arg_is_imm(src)) {
-        immediate_t imm = arg_to_imm(src);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-        if (arg_is_none(dest)) {
-            return instance;
-        }
-    }
-
-    if (arg_is_none(dest)) {
-        dest = src;
-    }
-
-    if (!arg_is_reg(dest)) {
-        return instr_instantiation_error;
-    }
-
-    has_modrm(instance) = true;
-    register_t reg_dest = arg_to_reg(dest);
-    uint8_t reg_dest_id = register_id_low(reg_dest);
-    if (register_id_high(reg_dest)) {
-        prefix_flag_r(instance) = true;
-        prefix_has_rex(instance) = true;
+// smallest displacement that encodes mem: none when the displacement is 0,
+// except for bp/r13 bases whose mod 0 encoding is taken by disp32 without a
+// base, then disp8 and finally disp32. rip relative and base-less operands
+// only exist with disp32. sp/r12 bases need a sib byte in every form, so
+// they don't change the choice.
+static inline uint8_t memory_pick_disp_size(memory_t mem) {
+    int64_t disp = memory_disp(mem);
+    register_t base = memory_base(mem);
+    if (register_is_none(base) || register_is_ip(base)) {
+        return ARG_SIZE_32;
     }
-    if (register_is_8_rex(reg_dest)) {
-        prefix_has_rex(instance) = true;
+    if (disp == 0 && register_id_low(base) != 0b101) {
+        return ARG_SIZE_NONE;
     }
-
-    if (arg_is_imm(src)) {
-        instance.modrm = make_modrm(MOD_DIRECT, 0, reg_dest_id);
-        return instance;
+    if (disp == (int8_t) disp) {
+        return ARG_SIZE_8;
     }
-    else if (!arg_is_reg(src)) {
-        return instr_instantiation_error;
+    if (disp == (int32_t) disp) {
+        return ARG_SIZE_32;
     }
+    return ARG_SIZE_64; // no such encoding, rejected by the caller
+}
 
-    register_t reg_src = arg_to_reg(src);
-    uint8_t reg_src_id = register_id_low(reg_src);
-    if (register_id_high(reg_src)) {
-        prefix_flag_b(instance) = true;
-        prefix_has_rex(instance) = true;
+static inline uint8_t memory_disp_mod(uint8_t disp_size) {
+    switch (disp_size) {
+    case ARG_SIZE_8:  return MOD_1;
+    case ARG_SIZE_32: return MOD_2;
+    default:          return MOD_0;
     }
-    if (register_is_8_rex(reg_src)) {
-        prefix_has_rex(instance) = true;
-    }
-
-    instance.modrm = make_modrm(MOD_DIRECT, reg_src_id, reg_dest_id);
-    return instance;
 }
 
-////////////////////////////////////////////////////////////////
+// group 2 override prefixes by segment register id
+static const uint8_t segment_override_prefix[6] = {
+    PREFIX_OVERRIDE_ES, PREFIX_OVERRIDE_CS, PREFIX_OVERRIDE_SS,
+    PREFIX_OVERRIDE_DS, PREFIX_OVERRIDE_FS, PREFIX_OVERRIDE_GS
+};
 
+// Fills in modrm.mod, modrm.rm, the sib byte, the displacement, REX.X and
+// REX.B and the segment override for mem. modrm.reg is left at 0 for the
+// caller to merge in, be it a register or an opcode extension.
 static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
-                                                      memory_t         mem,
-                                                      arg_t            arg) {
-    if (arg_is_mem(arg)) {
-        return instr_instantiation_error;
-    }
-
+                                                      memory_t         mem) {
     has_modrm(instance) = true;
 
-    uint8_t reg_id = 0;
-
-    if (arg_is_reg(arg)) {
-        register_t reg = arg_to_reg(arg);
-        reg_id = register_id_low(reg);
-        if (register_id_high(reg)) {
-            prefix_flag_r(instance) = true;
-            prefix_has_rex(instance) = true;
-        }
-        if (register_is_8_rex(reg)) {
-            prefix_has_rex(instance) = true;
-        }
-    }
-    else if (arg_is_imm(arg)) {
-        immediate_t imm = arg_to_imm(arg);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-    }
-    else if (!arg_is_none(arg)) {
-        return instr_instantiation_error;
+    if (!register_is_none(memory_segment(mem))) {
+        prefix_group_2(instance) = segment_override_prefix[register_id(memory_segment(mem))];
     }
 
-    // arg is fully handled and we never need to look at it again beyond reg_id
+    uint8_t reg_id = 0;
 
     register_t base = memory_base(mem);
     uint8_t base_id = register_id_low(base);
@@ -227,6 +242,9 @@ static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
     uint64_t disp = memory_disp(mem);
 
     uint8_t disp_size = memory_disp_size(mem);
+    if (disp_size == MEMORY_DISP_AUTO) {
+        disp_size = memory_pick_disp_size(mem);
+    }
 
     switch (scale) {
     case MEMORY_SCALE_1:
@@ -256,6 +274,14 @@ static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
     uint8_t sib_id = 0b100; // sp
     uint8_t ip_id = 0b101;  // bp
 
+    if (!register_is_none(index) && register_id(index) == sib_id) {
+        return instr_instantiation_error;
+    }
+    if (register_id_high(index)) {
+        prefix_flag_x(instance) = true;
+        prefix_has_rex(instance) = true;
+    }
+
     if (register_is_ip(base)) {
         if (!(disp_size == ARG_SIZE_32) || !register_is_none(index)) {
             return instr_instantiation_error;
@@ -273,37 +299,29 @@ static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
             instance.sib = make_sib(0, sib_id, ip_id);
         }
         else {
-            if (index_id == sib_id) {
-                return instr_instantiation_error;
-            }
-            instance.sib = make_sib(scale, sib_id, ip_id);
+            instance.sib = make_sib(scale, index_id, ip_id);
         }
         return instance;
     }
 
-    if (register_is_none(index)) {
-        if ((base_id == ip_id) && !memory_has_disp(mem)) {
-            return instr_instantiation_error;
-        }
+    // mod 0 with a bp/r13 base means disp32 without a base instead
+    if ((base_id == ip_id) && (disp_size == ARG_SIZE_NONE)) {
+        return instr_instantiation_error;
+    }
+    if (register_id_high(base)) {
+        prefix_flag_b(instance) = true;
+        prefix_has_rex(instance) = true;
+    }
 
-        instance.modrm = make_modrm(disp_size, reg_id, base_id);
+    if (register_is_none(index)) {
+        instance.modrm = make_modrm(memory_disp_mod(disp_size), reg_id, base_id);
         if (base_id == sib_id) {
             instance.sib = make_sib(0, sib_id, base_id);
         }
         return instance;
     }
 
-    instance.modrm = make_modrm(disp_size, reg_id, sib_id);
-
-    if (register_id_high(index)) {
-        prefix_flag_x(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-    if (register_id_high(base)) {
-        prefix_flag_b(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-
+    instance.modrm = make_modrm(memory_disp_mod(disp_size), reg_id, sib_id);
     instance.sib = make_sib(scale, index_id, base_id);
     return instance;
 }
@@ -311,13 +329,127 @@ static inline instr_instance_t add_args_memory_legacy(instr_instance_t instance,
 ////////////////////////////////////////////////////////////////
 
 static inline instr_instance_t instantiate_nop(instr_t instr);
+static inline instr_instance_t instantiate_branch(instr_t instr);
+static inline instr_instance_t instantiate_align(instr_t instr);
+static inline instr_instance_t instantiate_vector(instr_t instr);
+static inline instr_instance_t instantiate_fence(instr_t instr);
+
+static inline instr_instance_t instantiate_locked(instr_t instr);
 
 static inline instr_instance_t instruction_instantiate(instr_t instr) {
+    if (instr.lock) {
+        return instantiate_locked(instr);
+    }
     switch (instr.op) {
     case OP_NOP:
         return instantiate_nop(instr);
+    case OP_ALIGN:
+        return instantiate_align(instr);
+    case OP_SFENCE:
+        return instantiate_fence(instr);
+    case OP_JMP:
+    case OP_JCC:
+    case OP_CALL:
+        return instantiate_branch(instr);
+    case OP_SETCC:
+    case OP_CMOVCC:
     case OP_ADD:
-        return instantiate_legacy(instr, add_schemata);
+    case OP_OR:
+    case OP_ADC:
+    case OP_SBB:
+    case OP_AND:
+    case OP_SUB:
+    case OP_XOR:
+    case OP_CMP:
+    case OP_ROL:
+    case OP_ROR:
+    case OP_RCL:
+    case OP_RCR:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+    case OP_NOT:
+    case OP_NEG:
+    case OP_MUL:
+    case OP_IMUL:
+    case OP_DIV:
+    case OP_IDIV:
+    case OP_TEST:
+    case OP_MOV:
+    case OP_MOVZX:
+    case OP_MOVSX:
+    case OP_INC:
+    case OP_DEC:
+    case OP_XCHG:
+    case OP_XADD:
+    case OP_CMPXCHG:
+    case OP_CMPXCHG8B:
+    case OP_CMPXCHG16B:
+    case OP_MOVNTI:
+    case OP_MOVNTDQ:
+    case OP_PREFETCHT0:
+    case OP_PREFETCHT1:
+    case OP_PREFETCHT2:
+    case OP_PREFETCHNTA:
+    case OP_PREFETCHW:
+    case OP_POPCNT:
+    case OP_LZCNT:
+    case OP_TZCNT:
+    case OP_CRC32:
+    case OP_PMULLD:
+    case OP_PMINSD:
+    case OP_PMAXSD:
+    case OP_PMINUD:
+    case OP_PMAXUD:
+    case OP_PCMPEQQ:
+    case OP_PCMPGTQ:
+    case OP_PTEST:
+    case OP_PEXTRD:
+    case OP_PEXTRQ:
+    case OP_PINSRD:
+    case OP_PINSRQ:
+        return instantiate_legacy(instr, lookup_schema(instr));
+    case OP_VPADDD:
+    case OP_VPADDQ:
+    case OP_VPAND:
+    case OP_VPXOR:
+    case OP_VMOVDQU:
+    case OP_VMOVNTDQ:
+    case OP_VPBROADCASTB:
+    case OP_VPBROADCASTW:
+    case OP_VPBROADCASTD:
+    case OP_VPBROADCASTQ:
+    case OP_VPERMD:
+    case OP_VFMADD132PS:
+    case OP_VFMADD213PS:
+    case OP_VFMADD231PS:
+    case OP_VFMADD132PD:
+    case OP_VFMADD213PD:
+    case OP_VFMADD231PD:
+    case OP_SHLX:
+    case OP_SARX:
+    case OP_SHRX:
+    case OP_RORX:
+    case OP_BZHI:
+    case OP_PDEP:
+    case OP_PEXT:
+    case OP_ANDN:
+    case OP_BLSR:
+    case OP_MULX:
+    case OP_VPANDD:
+    case OP_VPANDQ:
+    case OP_VPXORD:
+    case OP_VPXORQ:
+    case OP_VMOVDQU32:
+    case OP_VMOVDQU64:
+    case OP_VPCMPEQD:
+    case OP_VPCMPGTD:
+    case OP_VPCOMPRESSD:
+    case OP_VPCOMPRESSQ:
+    case OP_VPEXPANDD:
+    case OP_VPEXPANDQ:
+    case OP_KMOVW:
+        return instantiate_vector(instr);
     default:
         return instr_instantiation_error;
     }
@@ -332,7 +464,165 @@ static inline instr_instance_t instantiate_nop(instr_t instr) {
     instr_instance_t instance = {0};
     instance_type(instance) = INSTR_TYPE_NOP;
 
-    instance.opcode = make_opcode(0x90, 1);
+    instance.opcode = 0x90;
     instance_nop_length(instance) = nop_length;
     return instance;
 }
+
+// align(alignment) pads to the next multiple of alignment, a power of two,
+// and align(alignment, max_skip) only does so if that takes at most
+// max_skip bytes.
+static inline instr_instance_t instantiate_align(instr_t instr) {
+    if (instr.len < 1 || instr.len > 2) {
+        return instr_instantiation_error;
+    }
+    for (int i = 0; i < instr.len; i++) {
+        if (!arg_is_imm(instr.args[i])) {
+            return instr_instantiation_error;
+        }
+    }
+
+    uint64_t alignment = immediate_data(arg_to_imm(instr.args[0]));
+    uint64_t max_skip = instr.len == 2
+        ? immediate_data(arg_to_imm(instr.args[1]))
+        : alignment - 1;
+    if (!alignment || (alignment & (alignment - 1)) || alignment > UINT32_MAX) {
+        return instr_instantiation_error;
+    }
+
+    instr_instance_t instance = {0};
+    instance_type(instance) = INSTR_TYPE_ALIGN;
+    instance_alignment(instance) = alignment;
+    instance_align_max_skip(instance) = max_skip < alignment ? max_skip : alignment - 1;
+    return instance;
+}
+
+// Relative branches take their displacement from the end of the instruction
+// as an immediate, whose declared size picks the rel8 or rel32 form. Label
+// targets are resolved to immediates by write_instruction_labels and
+// relax_block before they get here.
+static inline instr_instance_t instantiate_branch(instr_t instr) {
+    if (instr.len != 1 + (instr.op == OP_JCC)) {
+        return instr_instantiation_error;
+    }
+    arg_t target = instr.args[instr.len - 1];
+    if (!arg_is_imm(target)) {
+        return instr_instantiation_error;
+    }
+    bool rel_8 = arg_size(target) == ARG_SIZE_8;
+    if (!rel_8 && arg_size(target) != ARG_SIZE_32) {
+        return instr_instantiation_error;
+    }
+
+    opcode_t opcode;
+    switch (instr.op) {
+    case OP_JMP:
+        opcode = make_opcode(rel_8 ? 0xeb : 0xe9, 1);
+        break;
+    case OP_CALL:
+        if (rel_8) {
+            return instr_instantiation_error;
+        }
+        opcode = make_opcode(0xe8, 1);
+        break;
+    case OP_JCC:
+        if (!arg_is_cond(instr.args[0])) {
+            return instr_instantiation_error;
+        }
+        uint8_t cond = arg_to_cond(instr.args[0]);
+        opcode = rel_8 ? make_opcode(0x70 | cond, 1) : make_opcode(0x0f80 | cond, 2);
+        break;
+    default:
+        return instr_instantiation_error;
+    }
+
+    instr_instance_t instance = {0};
+    instance_set_opcode(&instance, opcode);
+    instance_type(instance) = INSTR_TYPE_LEGACY;
+    imm_size(instance) = arg_size(target);
+    instance.imm = immediate_signed(arg_to_imm(target));
+    return instance;
+}
+
+////////////////////////////////////////////////////////////////
+
+// sfence is 0F AE /7 with mod 3 and no operand, modrm.rm is ignored and
+// written as 0. SFENCE() passes a single arg_none.
+static inline instr_instance_t instantiate_fence(instr_t instr) {
+    if (instr.len > 1 || (instr.len == 1 && !arg_is_none(instr.args[0]))) {
+        return instr_instantiation_error;
+    }
+
+    instr_instance_t instance = {0};
+    instance_set_opcode(&instance, make_opcode(0x0fae, 2));
+    instance_type(instance) = INSTR_TYPE_LEGACY;
+    has_modrm(instance) = true;
+    instance.modrm = make_modrm(MOD_DIRECT, 7, 0);
+    return instance;
+}
+
+////////////////////////////////////////////////////////////////
+
+// LOCK is only valid on the ops in op_lockable with a memory destination,
+// and raises #UD anywhere else. The destination is always the first
+// operand, so the schema it matches is an r/m form.
+static inline instr_instance_t instantiate_locked(instr_t instr) {
+    if (instr.op >= NUM_OPS || !op_lockable[instr.op] ||
+        !instr.len || !arg_is_mem(instr.args[0])) {
+        return instr_instantiation_error;
+    }
+    instr.lock = false;
+    instr_instance_t instance = instruction_instantiate(instr);
+    if (instance_is_valid(instance)) {
+        prefix_group_1(instance) = PREFIX_LOCK;
+    }
+    return instance;
+}
+
+////////////////////////////////////////////////////////////////
+
+// Loads value into the general purpose register dest with the shortest
+// instruction that does it. For 32 and 64 bit registers, in order:
+//   xor r32, r32      2-3 bytes, for 0 when the flags are dead
+//   mov r32, imm32    5-6 bytes, zero extends into the 64 bit register
+//   mov r/m64, imm32  7 bytes, sign extends
+//   mov r64, imm64    10 bytes
+// 8 and 16 bit registers keep their upper bits, so they always get a mov
+// of their own size. That mov is never widened (see apply_lcp_policy), so a
+// 16 bit constant keeps its length changing prefix.
+// value is truncated to the size of dest.
+static inline instr_instance_t instantiate_constant(arg_t    dest,
+                                                    uint64_t value,
+                                                    bool     flags_dead) {
+    if (!arg_is_reg(dest) || !register_is_general(arg_to_reg(dest))) {
+        return instr_instantiation_error;
+    }
+
+    arg_t args[2] = {dest, arg_none};
+    instr_t instr = {.op = OP_MOV, .args = args, .len = 2};
+    uint8_t size = arg_size(dest);
+    arg_t dest_32 = arg_reg_32(register_id(arg_to_reg(dest)));
+    if (size == ARG_SIZE_32) {
+        value = (uint32_t) value;
+    }
+
+    if (size != ARG_SIZE_32 && size != ARG_SIZE_64) {
+        args[1] = arg_imm(value, size);
+    }
+    else if (value == 0 && flags_dead) {
+        instr.op = OP_XOR;
+        args[0] = dest_32;
+        args[1] = dest_32;
+    }
+    else if (value == (uint32_t) value) {
+        args[0] = dest_32;
+        args[1] = arg_imm_32(value);
+    }
+    else if (value == (uint64_t) (int32_t) value) {
+        args[1] = arg_imm_32(value);
+    }
+    else {
+        args[1] = arg_imm_64(value);
+    }
+    return instruction_instantiate(instr);
+}
@@ -4,306 +4,114 @@
 
 ////////////////////////////////////////////////////////////////
 
-static inline instr_instance_t add_sizes_vex(instr_instance_t instance,
-                                             instr_t          instr);
-
-static inline instr_instance_t add_args_vex(instr_instance_t instance,
-                                            arg_t            dest,
-                                            arg_t            src);
-
 static inline instr_instance_t add_args_memory_vex(instr_instance_t instance,
-                                                   memory_t         mem,
-                                                   arg_t            arg);
+                                                   memory_t         mem);
 
 ////////////////////////////////////////////////////////////////
 
-static inline instr_instance_t instantiate_vex(instr_t          instr,
-                                               instr_schemata_t schemata) {
-
-    uint32_t match_id = match_schema(schemata, instr);
-    if (match_id == -1) {
+// VEX schemata name the role of every operand, and the implied prefix, the
+// W and L bits come from the schema rather than from the operand sizes,
+// since those differ between operands (vpbroadcastd ymm, xmm/m32).
+// Instances never set has_rex, which shares its bit with vexsize_override.
+static inline instr_instance_t instantiate_vex(instr_t         instr,
+                                               instr_schema_t* schema) {
+    if (!schema || schema->len != instr.len) {
         return instr_instantiation_error;
     }
 
-    instr_schema_t match = schemata.schemata[match_id];
-
     instr_instance_t instance = {0};
 
-    instance.opcode = match.opcode;
-    instance_type(instance) = INSTR_TYPE_LEGACY;
-
-    instance = add_sizes_vex(instance, instr);
-    if (instance_is_invalid(instance)) {
-        return instr_instantiation_error;
-    }
-
-    arg_t dest = arg_none;
-    arg_t src = arg_none;
-
-    switch (instr.len) {
-    case 3:
-        if (!arg_is_imm(instr.args[2])) {
-            return instr_instantiation_error;
-        }
-        immediate_t imm = arg_to_imm(src);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-    case 2:
-        if (arg_info_id(match.args_info[1]) == (uint8_t) -1) {
-            src = instr.args[1];
-        }
-    case 1:
-        if (arg_info_id(match.args_info[0]) == (uint8_t) -1) {
-            dest = instr.args[0];
-        }
-    case 0:
-        break;
-    default:
+    if (!instance_set_opcode(&instance, schema->opcode) ||
+        opcode_map(instance) == OPCODE_MAP_NONE) {
         return instr_instantiation_error;
     }
+    instance_type(instance) = INSTR_TYPE_VEX;
+    prefix_vex_implicit(instance) = schema->prefix;
+    prefix_flag_w(instance) = schema->w;
+    prefix_vex_256(instance) = schema->l;
 
-    return add_args_vex(instance, dest, src);
-}
-
-////////////////////////////////////////////////////////////////
-
-static inline instr_instance_t add_sizes_vex(instr_instance_t instance,
-                                             instr_t          instr) {
-    uint8_t op_size = ARG_SIZE_NONE;
-    uint8_t addr_size = ARG_SIZE_NONE;
+    // modrm.rm is filled in by whichever operand comes first, so the reg
+    // field is only merged in at the end
+    uint8_t reg_id = schema->digit;
 
-    for (int i = 0; i < instr.len; i++) {
+    for (int i = 0; i < schema->len; i++) {
         arg_t arg = instr.args[i];
-        if (arg_is_mem(arg)) {
-            if (addr_size == ARG_SIZE_NONE) {
-                addr_size = arg_size(arg);
+        arg_info_t arg_info = schema->args_info[i];
+        switch (arg_info_role(arg_info)) {
+        case ARG_ROLE_REG:
+            if (!arg_is_reg(arg)) {
+                return instr_instantiation_error;
             }
-            else {
+            has_modrm(instance) = true;
+            reg_id = register_id_low(arg_to_reg(arg));
+            prefix_flag_r(instance) = register_id_high(arg_to_reg(arg)) != 0;
+            break;
+        case ARG_ROLE_VVVV:
+            if (!arg_is_reg(arg)) {
                 return instr_instantiation_error;
             }
-        }
-        if (arg_is_reg(arg)) {
-            if (op_size == ARG_SIZE_NONE) {
-                op_size = arg_size(arg);
+            prefix_vex_op_2(instance) = register_id(arg_to_reg(arg));
+            break;
+        case ARG_ROLE_RM:
+            if (arg_is_mem(arg)) {
+                instance = add_args_memory_vex(instance, arg_to_mem(arg));
+                if (instance_is_invalid(instance)) {
+                    return instr_instantiation_error;
+                }
+                break;
             }
-            else {
+            if (!arg_is_reg(arg)) {
                 return instr_instantiation_error;
             }
+            has_modrm(instance) = true;
+            instance.modrm = make_modrm(MOD_DIRECT, 0, register_id_low(arg_to_reg(arg)));
+            prefix_flag_b(instance) = register_id_high(arg_to_reg(arg)) != 0;
+            break;
+        case ARG_ROLE_IMM:
+            if (!arg_is_imm(arg)) {
+                return instr_instantiation_error;
+            }
+            imm_size(instance) = arg_info_size(arg_info);
+            instance.imm = immediate_signed(arg_to_imm(arg));
+            break;
+        default:
+            return instr_instantiation_error;
         }
     }
 
-    switch (addr_size) {
-    case ARG_SIZE_NONE:
-        break;
-    case ARG_SIZE_8:
-    case ARG_SIZE_16:
-        return instr_instantiation_error;
-    case ARG_SIZE_32:
-        addrsize_override(instance) = true;
-        break;
-    case ARG_SIZE_64:
-        break;
-    }
-
-    switch (op_size) {
-    case ARG_SIZE_NONE:
-    case ARG_SIZE_8:
-        break;
-    case ARG_SIZE_16:
-        opsize_override(instance) = true;
-    case ARG_SIZE_32:
-        break;
-    case ARG_SIZE_64:
-        prefix_flag_w(instance) = true;
-        prefix_has_rex(instance) = true;
-        break;
-    }
-
-    return instance;
-}
-
-////////////////////////////////////////////////////////////////
-
-static inline instr_instance_t add_args_vex(instr_instance_t instance,
-                                            arg_t            dest,
-                                            arg_t            src) {
-    if (arg_is_mem(dest)) {
-        return add_args_memory_vex(instance, arg_to_mem(dest), src);
-    }
-    if (arg_is_mem(src)) {
-        return add_args_memory_vex(instance, arg_to_mem(src), dest);
-    }
-
-    if (arg_is_imm(src)) {
-        immediate_t imm = arg_to_imm(src);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-        if (arg_is_none(dest)) {
-            return instance;
-        }
-    }
-
-    if (arg_is_none(dest)) {
-        dest = src;
-    }
-
-    if (!arg_is_reg(dest)) {
-        return instr_instantiation_error;
-    }
-
-    has_modrm(instance) = true;
-    register_t reg_dest = arg_to_reg(dest);
-    uint8_t reg_dest_id = register_id_low(reg_dest);
-    if (register_id_high(reg_dest)) {
-        prefix_flag_r(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-    if (register_is_8_rex(reg_dest)) {
-        prefix_has_rex(instance) = true;
-    }
-
-    if (arg_is_imm(src)) {
-        instance.modrm = make_modrm(MOD_DIRECT, 0, reg_dest_id);
-        return instance;
-    }
-    else if (!arg_is_reg(src)) {
-        return instr_instantiation_error;
-    }
-
-    register_t reg_src = arg_to_reg(src);
-    uint8_t reg_src_id = register_id_low(reg_src);
-    if (register_id_high(reg_src)) {
-        prefix_flag_b(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-    if (register_is_8_rex(reg_src)) {
-        prefix_has_rex(instance) = true;
-    }
-
-    instance.modrm = make_modrm(MOD_DIRECT, reg_src_id, reg_dest_id);
+    instance.modrm.reg = reg_id;
     return instance;
 }
 
 ////////////////////////////////////////////////////////////////
 
+// Memory operands are laid out exactly like the legacy ones, so this builds
+// them on a scratch legacy instance and keeps the modrm, sib, displacement
+// and the X and B bits, which VEX stores inverted but in the same fields.
 static inline instr_instance_t add_args_memory_vex(instr_instance_t instance,
-                                                   memory_t         mem,
-                                                   arg_t            arg) {
-    if (arg_is_mem(arg)) {
-        return instr_instantiation_error;
-    }
-
-    has_modrm(instance) = true;
-
-    uint8_t reg_id = 0;
-
-    if (arg_is_reg(arg)) {
-        register_t reg = arg_to_reg(arg);
-        reg_id = register_id_low(reg);
-        if (register_id_high(reg)) {
-            prefix_flag_r(instance) = true;
-            prefix_has_rex(instance) = true;
-        }
-        if (register_is_8_rex(reg)) {
-            prefix_has_rex(instance) = true;
-        }
-    }
-    else if (arg_is_imm(arg)) {
-        immediate_t imm = arg_to_imm(arg);
-        imm_size(instance) = immediate_size(imm);
-        instance.imm = immediate_data(imm);
-    }
-    else if (!arg_is_none(arg)) {
+                                                   memory_t         mem) {
+    // the 67 and segment override prefixes would have to go in front of
+    // the VEX prefix, which VEX instances have no field for
+    if (!register_is_none(memory_segment(mem)) ||
+        register_is_32(memory_base(mem)) ||
+        register_is_32_ip(memory_base(mem)) ||
+        register_is_32(memory_index(mem))) {
         return instr_instantiation_error;
     }
 
-    // arg is fully handled and we never need to look at it again beyond reg_id
-
-    register_t base = memory_base(mem);
-    uint8_t base_id = register_id_low(base);
-    register_t index = memory_index(mem);
-    uint8_t index_id = register_id_low(index);
-    uint8_t scale = memory_scale(mem);
-    uint64_t disp = memory_disp(mem);
-
-    uint8_t disp_size = memory_disp_size(mem);
-
-    switch (scale) {
-    case MEMORY_SCALE_1:
-        scale = 0b00;
-        break;
-    case MEMORY_SCALE_2:
-        scale = 0b01;
-        break;
-    case MEMORY_SCALE_4:
-        scale = 0b10;
-        break;
-    case MEMORY_SCALE_8:
-        scale = 0b11;
-        break;
-    }
-
-    if (disp_size == ARG_SIZE_NONE ||
-        disp_size == ARG_SIZE_8 ||
-        disp_size == ARG_SIZE_32) {
-        disp_size(instance) = disp_size;
-        instance.disp = disp;
-    }
-    else {
+    instr_instance_t legacy = {0};
+    instance_type(legacy) = INSTR_TYPE_LEGACY;
+    legacy = add_args_memory_legacy(legacy, mem);
+    if (instance_is_invalid(legacy)) {
         return instr_instantiation_error;
     }
 
-    uint8_t sib_id = 0b100; // sp
-    uint8_t ip_id = 0b101;  // bp
-
-    if (register_is_ip(base)) {
-        if (!(disp_size == ARG_SIZE_32) || !register_is_none(index)) {
-            return instr_instantiation_error;
-        }
-        instance.modrm = make_modrm(MOD_0, reg_id, ip_id);
-        return instance;
-    }
-
-    if (register_is_none(base)) {
-        if (disp_size != ARG_SIZE_32) {
-            return instr_instantiation_error;
-        }
-        instance.modrm = make_modrm(MOD_0, reg_id, sib_id);
-        if (register_is_none(index)) {
-            instance.sib = make_sib(0, sib_id, ip_id);
-        }
-        else {
-            if (index_id == sib_id) {
-                return instr_instantiation_error;
-            }
-            instance.sib = make_sib(scale, sib_id, ip_id);
-        }
-        return instance;
-    }
-
-    if (register_is_none(index)) {
-        if ((base_id == ip_id) && !memory_has_disp(mem)) {
-            return instr_instantiation_error;
-        }
-
-        instance.modrm = make_modrm(disp_size, reg_id, base_id);
-        if (base_id == sib_id) {
-            instance.sib = make_sib(0, sib_id, base_id);
-        }
-        return instance;
-    }
-
-    instance.modrm = make_modrm(disp_size, reg_id, sib_id);
-
-    if (register_id_high(index)) {
-        prefix_flag_x(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-    if (register_id_high(base)) {
-        prefix_flag_b(instance) = true;
-        prefix_has_rex(instance) = true;
-    }
-
-    instance.sib = make_sib(scale, index_id, base_id);
+    has_modrm(instance) = true;
+    instance.modrm = legacy.modrm;
+    instance.sib = legacy.sib;
+    instance.disp = legacy.disp;
+    disp_size(instance) = disp_size(legacy);
+    prefix_flag_x(instance) = prefix_flag_x(legacy);
+    prefix_flag_b(instance) = prefix_flag_b(legacy);
     return instance;
 }
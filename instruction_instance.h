@@ -19,9 +19,9 @@ typedef struct {
     uint8_t flag_x : 1;
     uint8_t flag_b : 1;
     uint8_t prefix_group_1 : 2;
-    uint8_t prefix_group_2 : 3;
     uint8_t prefix_group_3 : 1;
     uint8_t prefix_group_4 : 1;
+    uint8_t prefix_group_2 : 3;
     uint8_t has_rex : 1;
 } prefixes_legacy_t;
 
@@ -30,33 +30,59 @@ typedef struct {
     uint8_t flag_r : 1;
     uint8_t flag_x : 1;
     uint8_t flag_b : 1;
+    uint8_t op_2 : 4;
     uint8_t size_256 : 1;
-    uint8_t map_select : 5;
     uint8_t implicit : 2;
-    uint8_t op_2 : 4;
     uint8_t vexsize_override : 1;
 } prefixes_vex_t;
 
+// Shares W, R, X, B and vvvv with the VEX layout. R2 and V2 are the fifth
+// bits of the modrm.reg and vvvv register ids, the fifth bit of a register
+// in modrm.rm goes in X. size is L'L.
 typedef struct {
-    uint64_t length;
-} prefixes_nop_t;
+    uint8_t flag_w : 1;
+    uint8_t flag_r : 1;
+    uint8_t flag_x : 1;
+    uint8_t flag_b : 1;
+    uint8_t op_2 : 4;
+    uint8_t implicit : 2;
+    uint8_t size : 2;
+    uint8_t flag_r2 : 1;
+    uint8_t flag_v2 : 1;
+    uint8_t broadcast : 1;
+    uint8_t zeroing : 1;
+    uint8_t mask : 3;
+} prefixes_evex_t;
 
+// The opcode of an instance is its last opcode byte plus the escape map it
+// sits in, which is both what legacy encodings write in front of it and
+// what VEX encodings put in their map_select field.
 typedef struct {
     uint8_t instance_type : 3;
     uint8_t has_modrm : 1;
     uint8_t disp_size : 2;
-    uint8_t imm_size : 2;
+    uint8_t opcode_map : 2;
+    uint8_t imm_size : 3;
     union {
         prefixes_legacy_t legacy;
         prefixes_vex_t vex;
-        prefixes_nop_t nop;
+        prefixes_evex_t evex;
     };
 } misc_t;
 
+#define OPCODE_MAP_NONE 0
+#define OPCODE_MAP_0F   1
+#define OPCODE_MAP_0F38 2
+#define OPCODE_MAP_0F3A 3
+
+#define INSTR_MAX_LEN 15
+
 #define INSTR_TYPE_LEGACY 1
 #define INSTR_TYPE_VEX    2
 #define INSTR_TYPE_3DNOW  3
 #define INSTR_TYPE_NOP    4
+#define INSTR_TYPE_ALIGN  5
+#define INSTR_TYPE_EVEX   6
 
 #define PREFIX_LOCK  1
 #define PREFIX_REPNZ 2
@@ -73,6 +99,15 @@ typedef struct {
 #define PREFIX_VEX_IMPLICIT_F3 2
 #define PREFIX_VEX_IMPLICIT_F2 3
 
+// legacy encodings write the same prefixes as mandatory prefixes
+#define PREFIX_MANDATORY_66 PREFIX_VEX_IMPLICIT_66
+#define PREFIX_MANDATORY_F3 PREFIX_VEX_IMPLICIT_F3
+#define PREFIX_MANDATORY_F2 PREFIX_VEX_IMPLICIT_F2
+
+#define PREFIX_EVEX_SIZE_128 0
+#define PREFIX_EVEX_SIZE_256 1
+#define PREFIX_EVEX_SIZE_512 2
+
 ////////////////////////////////////////////////////////////////
 
 typedef struct {
@@ -107,19 +142,34 @@ typedef struct {
 
 ////////////////////////////////////////////////////////////////
 
+// Kept at 16 bytes so instances travel in two registers when passed and
+// returned by value. disp holds the upper half of the immediate for the
+// 64 bit immediate forms, which never have a displacement. Instantiation
+// failures are reported through instr_error instead of the instance.
 typedef struct {
-    uint64_t disp;
-    uint64_t imm;
-    opcode_t opcode;
-    misc_t misc;
+    uint32_t disp;
+    uint32_t imm;
+    uint8_t opcode;
     modrm_t modrm;
     sib_t sib;
+    misc_t misc;
 } instr_instance_t;
 
-#define instr_instantiation_error ((instr_instance_t) { \
-    .disp = __LINE__, \
-    .imm = (uint64_t) __FILE__ \
-})
+_Static_assert(sizeof(instr_instance_t) == 16, "instr_instance_t must stay 16 bytes");
+
+typedef struct {
+    uint32_t line;
+    const char* file;
+} instr_error_t;
+
+static _Thread_local instr_error_t instr_error;
+
+static inline instr_instance_t instr_fail(uint32_t line, const char* file) {
+    instr_error = (instr_error_t) {.line = line, .file = file};
+    return (instr_instance_t) {0};
+}
+
+#define instr_instantiation_error instr_fail(__LINE__, __FILE__)
 
 #define disp_size(instr) ((instr).misc.disp_size)
 #define imm_size(instr) ((instr).misc.imm_size)
@@ -130,25 +180,41 @@ typedef struct {
     ((instr).modrm.mod != 0b11) && \
     ((instr).modrm.rm == 0b100) \
 )
+#define has_rip_disp(instr) ( \
+    has_modrm(instr) && \
+    ((instr).modrm.mod == MOD_0) && \
+    ((instr).modrm.rm == 0b101) \
+)
 
-#define opcode_len(instr) ((instr).opcode.len)
-#define opcode_val(instr) ((instr).opcode.val)
+#define opcode_map(instr) ((instr).misc.opcode_map)
+#define opcode_len(instr) (opcode_map(instr) == OPCODE_MAP_NONE ? 1 : \
+                           opcode_map(instr) == OPCODE_MAP_0F ? 2 : 3)
 
 #define instance_type(instr) ((instr).misc.instance_type)
 #define instance_is_none(instr) (!instance_type(instr))
 #define instance_is_legacy(instr) (instance_type(instr) == INSTR_TYPE_LEGACY)
 #define instance_is_vex(instr) (instance_type(instr) == INSTR_TYPE_VEX)
+#define instance_is_evex(instr) (instance_type(instr) == INSTR_TYPE_EVEX)
 #define instance_is_3dnow(instr) (instance_type(instr) == INSTR_TYPE_3DNOW)
 #define instance_is_nop(instr) (instance_type(instr) == INSTR_TYPE_NOP)
+#define instance_is_align(instr) (instance_type(instr) == INSTR_TYPE_ALIGN)
+// nops and alignment both turn into padding when written
+#define instance_is_padding(instr) (instance_is_nop(instr) || instance_is_align(instr))
 
 #define prefix_legacy(instr) ((instr).misc.legacy)
 #define prefix_vex(instr) ((instr).misc.vex)
+#define prefix_evex(instr) ((instr).misc.evex)
 
 #define prefix_group_1(instr) (prefix_legacy(instr).prefix_group_1)
 #define prefix_group_2(instr) (prefix_legacy(instr).prefix_group_2)
 #define prefix_group_3(instr) (prefix_legacy(instr).prefix_group_3)
 #define prefix_group_4(instr) (prefix_legacy(instr).prefix_group_4)
 #define opsize_override(instr) prefix_group_3(instr)
+// a 66 prefix in front of an imm16 changes the instruction length the
+// predecoder assumed, which stalls it for several cycles on Intel cores
+#define instance_has_lcp(instr) (instance_is_legacy(instr) && \
+                                 opsize_override(instr) && \
+                                 imm_size(instr) == ARG_SIZE_16)
 #define addrsize_override(instr) prefix_group_4(instr)
 
 #define prefix_has_rex(instr) (prefix_legacy(instr).has_rex)
@@ -157,13 +223,55 @@ typedef struct {
 #define prefix_flag_r(instr) (prefix_legacy(instr).flag_r)
 #define prefix_flag_w(instr) (prefix_legacy(instr).flag_w)
 
-#define prefix_vex_map_select(instr) (prefix_vex(instr).map_select)
+#define prefix_vex_map_select(instr) opcode_map(instr)
 #define prefix_vex_op_2(instr) (prefix_vex(instr).op_2)
 #define prefix_vex_256(instr) (prefix_vex(instr).size_256)
 #define prefix_vex_implicit(instr) (prefix_vex(instr).implicit)
 #define prefix_vex_vexsize_override(instr) (prefix_vex(instr).vexsize_override)
 
-#define instance_nop_length(instr) ((instr).misc.nop.length)
+#define prefix_evex_implicit(instr) (prefix_evex(instr).implicit)
+#define prefix_evex_size(instr) (prefix_evex(instr).size)
+#define prefix_evex_flag_r2(instr) (prefix_evex(instr).flag_r2)
+#define prefix_evex_flag_v2(instr) (prefix_evex(instr).flag_v2)
+#define prefix_evex_broadcast(instr) (prefix_evex(instr).broadcast)
+#define prefix_evex_zeroing(instr) (prefix_evex(instr).zeroing)
+#define prefix_evex_mask(instr) (prefix_evex(instr).mask)
+
+#define instance_nop_length(instr) ((instr).imm)
+// align instances pad to a multiple of alignment unless that takes more
+// than max_skip bytes, in which case they write nothing
+#define instance_alignment(instr) ((instr).imm)
+#define instance_align_max_skip(instr) ((instr).disp)
+
+#define instance_is_invalid(instr) instance_is_none(instr)
+#define instance_is_valid(instr) (!instance_is_none(instr))
+
+#define instance_imm(instr) (imm_size(instr) == ARG_SIZE_64 ? \
+    ((uint64_t) (instr).disp << 32) | (instr).imm : (instr).imm)
+
+inline static void instance_set_imm(instr_instance_t* instance, uint64_t imm) {
+    instance->imm = imm;
+    if (imm_size(*instance) == ARG_SIZE_64) {
+        instance->disp = imm >> 32;
+    }
+}
 
-#define instance_is_invalid(instr) (opcode_len(instr) == 0)
-#define instance_is_valid(instr) (opcode_len(instr) != 0)
+// splits a schema opcode into map and final byte, false for opcodes that
+// are not in one of the escape maps
+inline static bool instance_set_opcode(instr_instance_t* instance,
+                                       opcode_t          opcode) {
+    uint32_t escape = opcode.val >> 8;
+    instance->opcode = opcode.val & 0xff;
+    switch (opcode.len) {
+    case 1:
+        opcode_map(*instance) = OPCODE_MAP_NONE;
+        return true;
+    case 2:
+        opcode_map(*instance) = OPCODE_MAP_0F;
+        return escape == 0x0f;
+    case 3:
+        opcode_map(*instance) = escape == 0x0f38 ? OPCODE_MAP_0F38 : OPCODE_MAP_0F3A;
+        return escape == 0x0f38 || escape == 0x0f3a;
+    }
+    return false;
+}
@@ -0,0 +1,272 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "label.h"
+
+////////////////////////////////////////////////////////////////
+
+#define instr_is_branch(instr) \
+    ((instr).op == OP_JMP || (instr).op == OP_JCC || (instr).op == OP_CALL)
+
+// the last argument, arg_none for a branch without arguments
+#define instr_branch_target(instr) \
+    ((instr).len ? (instr).args[(instr).len - 1] : arg_none)
+
+// jmp rel8 and jcc rel8 are 2 bytes, jmp rel32 and call rel32 5, jcc rel32 6
+#define branch_length(op, rel_8) ((rel_8) ? 2 : ((op) == OP_JCC ? 6 : 5))
+
+#define branch_can_be_short(op) ((op) != OP_CALL)
+
+// instantiates a branch with its label target replaced by rel
+static inline instr_instance_t instantiate_branch_rel(instr_t instr,
+                                                      int64_t rel,
+                                                      bool    rel_8) {
+    if (instr.len < 1 || instr.len > 2) {
+        return instr_instantiation_error;
+    }
+    arg_t args[2] = {instr.args[0], instr.args[instr.len - 1]};
+    args[instr.len - 1] = rel_8 ? arg_imm_8(rel) : arg_imm_32(rel);
+    instr.args = args;
+    return instruction_instantiate(instr);
+}
+
+// writes a rel32 branch to an unbound label, patched by label_bind
+static inline bool write_branch_fixup(buffer_t* buf,
+                                      labels_t* labels,
+                                      instr_t   instr,
+                                      uint32_t  label) {
+    if (!write_instruction_instance(buf, instantiate_branch_rel(instr, 0, false))) {
+        return false;
+    }
+    return label_add_fixup(labels, label, buf->cursor - 4);
+}
+
+////////////////////////////////////////////////////////////////
+
+// Streaming counterpart of write_instruction_instance that understands
+// labels: OP_LABEL binds its label at the cursor, branches to bound labels
+// use rel8 when the target is in reach, and branches to labels that are
+// not bound yet get a rel32 that label_bind fills in later.
+static inline bool write_instruction_labels(buffer_t* buf,
+                                            labels_t* labels,
+                                            instr_t   instr) {
+    if (instr.op == OP_LABEL) {
+        if (instr.len != 1 || !arg_is_label(instr.args[0])) {
+            return false;
+        }
+        return label_bind(labels, buf, arg_to_label(instr.args[0]));
+    }
+
+    if (!instr_is_branch(instr) || !arg_is_label(instr_branch_target(instr))) {
+        return write_instruction_instance(buf, instruction_instantiate(instr));
+    }
+
+    uint32_t label = arg_to_label(instr_branch_target(instr));
+    if (!label_is_valid(labels, label)) {
+        return false;
+    }
+    if (!label_is_bound(labels, label)) {
+        return write_branch_fixup(buf, labels, instr, label);
+    }
+
+    // the jcc erratum mode may pad in front of the branch and move it
+    uint64_t target = label_entry(labels, label)->offset;
+    uint64_t length = branch_length(instr.op, true);
+    uint64_t end = buf->cursor + jcc_erratum_branch_padding(buf, length, instr.op == OP_JCC) + length;
+    int64_t rel = target - end;
+    bool rel_8 = branch_can_be_short(instr.op) && rel == (int8_t) rel;
+    if (!rel_8) {
+        length = branch_length(instr.op, false);
+        end = buf->cursor + jcc_erratum_branch_padding(buf, length, instr.op == OP_JCC) + length;
+        rel = target - end;
+    }
+    return write_instruction_instance(buf, instantiate_branch_rel(instr, rel, rel_8));
+}
+
+////////////////////////////////////////////////////////////////
+
+// Per instruction state of relax_block, kept in labels->scratch.
+typedef struct {
+    instr_instance_t instance;
+    uint32_t offset;
+    uint32_t length;
+} relax_entry_t;
+
+// offset of label relative to the start of the block, false when the label
+// is neither bound nor defined in the block
+static inline bool relax_target(labels_t*      labels,
+                                relax_entry_t* entries,
+                                uint64_t       start,
+                                uint32_t       label,
+                                int64_t*       target) {
+    label_entry_t* entry = label_entry(labels, label);
+    if (entry->block_index) {
+        *target = entries[entry->block_index - 1].offset;
+        return true;
+    }
+    if (entry->offset != LABEL_UNBOUND) {
+        *target = (int64_t) (entry->offset - start);
+        return true;
+    }
+    return false;
+}
+
+static inline void relax_clear_block(labels_t* labels,
+                                     instr_t*  instrs,
+                                     uint64_t  n) {
+    for (uint64_t i = 0; i < n; i++) {
+        if (instrs[i].op == OP_LABEL &&
+            instrs[i].len == 1 &&
+            arg_is_label(instrs[i].args[0]) &&
+            label_is_valid(labels, arg_to_label(instrs[i].args[0]))) {
+            label_entry(labels, arg_to_label(instrs[i].args[0]))->block_index = 0;
+        }
+    }
+}
+
+// Assembles a block of n instructions in which OP_LABEL entries bind labels,
+// giving every branch the shortest form that reaches its target in the
+// final layout. Branches start out as rel8 and each pass widens the ones
+// whose target ended up out of range, recomputing alignment padding for the
+// new layout. Branches never shrink back, so this settles after a handful
+// of passes. Branches to labels that are
+// bound neither before nor inside the block are left as rel32 fixups.
+static inline bool relax_block(buffer_t* buf,
+                               labels_t* labels,
+                               instr_t*  instrs,
+                               uint64_t  n) {
+    if (!buf_reserve(&labels->scratch, n * sizeof(relax_entry_t))) {
+        return false;
+    }
+    relax_entry_t* entries = (relax_entry_t*) labels->scratch.data;
+    uint64_t start = buf->cursor;
+    bool ok = true;
+    // the layout below can't see a fusible instruction written before the
+    // block, so don't let the writer pair a leading jcc with it either
+    jcc_erratum_barrier();
+
+    // labels defined in the block, so the sizing pass can find them
+    for (uint64_t i = 0; i < n && ok; i++) {
+        if (instrs[i].op != OP_LABEL) {
+            continue;
+        }
+        uint32_t label = instrs[i].len == 1 && arg_is_label(instrs[i].args[0])
+            ? arg_to_label(instrs[i].args[0])
+            : LABEL_NONE;
+        if (!label_is_valid(labels, label) ||
+            label_is_bound(labels, label) ||
+            label_entry(labels, label)->block_index) {
+            relax_clear_block(labels, instrs, i);
+            return false;
+        }
+        label_entry(labels, label)->block_index = i + 1;
+    }
+
+    // everything but branches to labels has a fixed length
+    for (uint64_t i = 0; i < n && ok; i++) {
+        instr_t instr = instrs[i];
+        entries[i].instance = (instr_instance_t) {0};
+        entries[i].length = 0;
+        if (instr.op == OP_LABEL) {
+            continue;
+        }
+        if (instr_is_branch(instr) && arg_is_label(instr_branch_target(instr))) {
+            uint32_t label = arg_to_label(instr_branch_target(instr));
+            int64_t target;
+            ok = label_is_valid(labels, label);
+            bool rel_8 = ok &&
+                         branch_can_be_short(instr.op) &&
+                         relax_target(labels, entries, start, label, &target);
+            entries[i].length = branch_length(instr.op, rel_8);
+            // catch malformed branches before anything is written
+            ok = ok && instance_is_valid(instantiate_branch_rel(instr, 0, rel_8));
+            continue;
+        }
+        entries[i].instance = instruction_instantiate(instr);
+        ok = instance_is_valid(entries[i].instance);
+        entries[i].length = instruction_length(entries[i].instance);
+    }
+
+    for (bool changed = ok; changed;) {
+        changed = false;
+        uint64_t offset = 0;
+        // last fusible instruction for the jcc erratum mode, mirroring what
+        // write_instance_jcc_erratum will do with the final layout
+        uint64_t fused = n;
+        for (uint64_t i = 0; i < n; i++) {
+            entries[i].offset = offset;
+            if (instance_is_align(entries[i].instance)) {
+                entries[i].length = align_padding(entries[i].instance, start + offset);
+            }
+            if (instrs[i].op == OP_LABEL) {
+                fused = n;
+            }
+            if (jcc_erratum.enabled) {
+                bool label_branch = instr_is_branch(instrs[i]) &&
+                                    arg_is_label(instr_branch_target(instrs[i]));
+                bool jcc = label_branch ? instrs[i].op == OP_JCC
+                                        : instance_is_jcc(entries[i].instance);
+                if (label_branch || instance_is_branch(entries[i].instance)) {
+                    bool pair = jcc && fused < n &&
+                                entries[fused].offset + entries[fused].length == offset;
+                    uint64_t from = pair ? entries[fused].offset : offset;
+                    uint64_t padding = jcc_erratum_padding(start + from,
+                                                           start + offset + entries[i].length);
+                    if (pair) {
+                        entries[fused].offset += padding;
+                    }
+                    offset += padding;
+                    entries[i].offset = offset;
+                }
+                fused = instance_is_fusible(entries[i].instance) ? i : n;
+            }
+            offset += entries[i].length;
+        }
+        if (offset > UINT32_MAX) {
+            ok = false;
+            break;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (entries[i].length != 2 || !instr_is_branch(instrs[i]) ||
+                !arg_is_label(instr_branch_target(instrs[i]))) {
+                continue;
+            }
+            int64_t target;
+            relax_target(labels, entries, start,
+                         arg_to_label(instr_branch_target(instrs[i])), &target);
+            int64_t rel = target - (entries[i].offset + 2);
+            if (rel != (int8_t) rel) {
+                entries[i].length = branch_length(instrs[i].op, false);
+                changed = true;
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < n && ok; i++) {
+        instr_t instr = instrs[i];
+        if (instr.op == OP_LABEL) {
+            uint32_t label = arg_to_label(instr.args[0]);
+            label_entry(labels, label)->block_index = 0;
+            ok = label_bind(labels, buf, label);
+        }
+        else if (instr_is_branch(instr) && arg_is_label(instr_branch_target(instr))) {
+            uint32_t label = arg_to_label(instr_branch_target(instr));
+            int64_t target;
+            if (relax_target(labels, entries, start, label, &target)) {
+                bool rel_8 = entries[i].length == 2;
+                int64_t rel = target - (entries[i].offset + entries[i].length);
+                ok = write_instruction_instance(buf, instantiate_branch_rel(instr, rel, rel_8));
+            }
+            else {
+                ok = write_branch_fixup(buf, labels, instr, label);
+            }
+        }
+        else {
+            ok = write_instruction_instance(buf, entries[i].instance);
+        }
+    }
+
+    relax_clear_block(labels, instrs, n);
+    return ok;
+}
@@ -4,26 +4,89 @@
 
 ////////////////////////////////////////////////////////////////
 
+// Where an operand goes in the encoding. Schemata that the encoders
+// instantiate spell it out for every operand, ARG_ROLE_AUTO is what
+// make_instr_schema leaves behind and is rejected.
+#define ARG_ROLE_AUTO   0
+#define ARG_ROLE_REG    1 // modrm.reg
+#define ARG_ROLE_RM     2 // modrm.rm
+#define ARG_ROLE_VVVV   3 // VEX.vvvv
+#define ARG_ROLE_IMM    4
+#define ARG_ROLE_BCST   5 // modrm.rm, one element broadcast with EVEX.b
+#define ARG_ROLE_FIXED  6 // a register the opcode implies, not encoded
+#define ARG_ROLE_OPCODE 7 // a register in the low 3 bits of the opcode
+#define ARG_ROLE_COND   8 // a condition code in the low 4 bits of the opcode
+
+// reg_class is the REGISTER_CLASS_* register operands have to be in. The
+// constructors below derive it from the size, 128 bits and up are vector
+// registers and the rest general purpose ones. Other classes have
+// constructors of their own, like mask_type_as.
 typedef struct {
     uint8_t id;
     uint8_t size : 4;
     uint8_t type : 4;
+    uint8_t role : 4;
+    uint8_t reg_class : 4;
 } arg_info_t;
 
-#define reg_type_id(size_, id_) ((arg_info_t) {.type = ARG_TYPE_REG, .size = size_, .id = id_})
+#define reg_class_for_size(size_) \
+    ((size_) == ARG_SIZE_128 || (size_) == ARG_SIZE_256 || (size_) == ARG_SIZE_512 \
+        ? REGISTER_CLASS_VECTOR : REGISTER_CLASS_GPR)
+
+#define reg_type_id(size_, id_) ((arg_info_t) {.type = ARG_TYPE_REG, .size = size_, .id = id_, \
+    .reg_class = reg_class_for_size(size_)})
 #define reg_type(size_) (reg_type_id(size_, -1))
 #define mem_type(size_) ((arg_info_t) {.type = ARG_TYPE_MEM, .size = size_, .id = -1})
-#define memreg_type(size_) ((arg_info_t) {.type = ARG_TYPE_MEMREG, .size = size_, .id = -1})
+#define memreg_type(size_) ((arg_info_t) {.type = ARG_TYPE_MEMREG, .size = size_, .id = -1, \
+    .reg_class = reg_class_for_size(size_)})
 #define imm_type(size_) ((arg_info_t) {.type = ARG_TYPE_IMM, .size = size_, .id = -1})
 
+#define reg_type_as(size_, role_) \
+    ((arg_info_t) {.type = ARG_TYPE_REG, .size = size_, .id = -1, .role = role_, \
+        .reg_class = reg_class_for_size(size_)})
+#define mem_type_as(size_, role_) \
+    ((arg_info_t) {.type = ARG_TYPE_MEM, .size = size_, .id = -1, .role = role_})
+#define memreg_type_as(size_, role_) \
+    ((arg_info_t) {.type = ARG_TYPE_MEMREG, .size = size_, .id = -1, .role = role_, \
+        .reg_class = reg_class_for_size(size_)})
+#define imm_type_as(size_) \
+    ((arg_info_t) {.type = ARG_TYPE_IMM, .size = size_, .id = -1, .role = ARG_ROLE_IMM})
+#define bcst_type_as(size_) \
+    ((arg_info_t) {.type = ARG_TYPE_MEM, .size = size_, .id = -1, .role = ARG_ROLE_BCST})
+#define cond_type_as() \
+    ((arg_info_t) {.type = ARG_TYPE_COND, .size = ARG_SIZE_NONE, .id = -1, .role = ARG_ROLE_COND})
+#define reg_type_fixed(size_, id_) \
+    ((arg_info_t) {.type = ARG_TYPE_REG, .size = size_, .id = id_, .role = ARG_ROLE_FIXED})
+// an opmask register k0-k7
+#define mask_type_as(role_) \
+    ((arg_info_t) {.type = ARG_TYPE_REG, .size = ARG_SIZE_64, .id = -1, .role = role_, \
+        .reg_class = REGISTER_CLASS_MASK})
+
 #define arg_info_type(arg_info) ((arg_info).type)
 #define arg_info_size(arg_info) ((arg_info).size)
 #define arg_info_id(arg_info) ((arg_info).id)
+#define arg_info_role(arg_info) ((arg_info).role)
+#define arg_info_reg_class(arg_info) ((arg_info).reg_class)
 
+// prefix is the implied 66/F3/F2 prefix (PREFIX_VEX_IMPLICIT_*), w and l
+// the VEX.W and VEX.L bits, or W and L'L (PREFIX_EVEX_SIZE_*) for EVEX
+// schemata. disp8_elem makes EVEX disp8 scale by the element size the W
+// bit selects rather than by the memory operand, for compress and expand.
+// Legacy schemata use prefix for the mandatory prefix (PREFIX_MANDATORY_*),
+// w for REX.W and opsize for a 66 operand size prefix. digit is the opcode
+// extension that goes in modrm.reg when no operand has ARG_ROLE_REG, the
+// /digit of the manuals.
 typedef struct {
     arg_info_t* args_info;
     opcode_t opcode;
     uint8_t len;
+    uint8_t prefix : 2;
+    uint8_t w : 1;
+    uint8_t l : 2;
+    uint8_t evex : 1;
+    uint8_t disp8_elem : 1;
+    uint8_t opsize : 1;
+    uint8_t digit : 3;
 } instr_schema_t;
 
 typedef struct {
@@ -49,6 +112,10 @@ static inline uint32_t match_schema(instr_schemata_t schemata, instr_t instr) {
                     break;
                 }
             }
+            if (arg_is_reg(arg) &&
+                register_class(arg_to_reg(arg)) != arg_info_reg_class(arg_info)) {
+                break;
+            }
             if (arg_info_type(arg_info) == ARG_TYPE_REG) {
                 uint8_t reg_id = arg_info_id(arg_info);
                 if ((reg_id != (uint8_t) -1) &&
@@ -71,12 +138,79 @@ static inline uint32_t match_schema(instr_schemata_t schemata, instr_t instr) {
 
 ////////////////////////////////////////////////////////////////
 
+// schemata are parenthesized compound literals so that num_args in
+// make_instr_schemata sees one argument per schema
 #define make_instr_schema(opcode_, ...) \
-{ \
+((instr_schema_t) { \
     .opcode = opcode_, \
     .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
     .len = num_args(__VA_ARGS__) \
-}
+})
+
+#define make_legacy_schema(opcode_, prefix_, w_, opsize_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .opsize = opsize_ \
+})
+
+#define make_legacy_digit_schema(opcode_, digit_, prefix_, w_, opsize_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .opsize = opsize_, \
+    .digit = digit_ \
+})
+
+#define make_vex_schema(opcode_, prefix_, w_, l_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .l = l_ \
+})
+
+#define make_vex_digit_schema(opcode_, digit_, prefix_, w_, l_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .l = l_, \
+    .digit = digit_ \
+})
+
+#define make_evex_schema(opcode_, prefix_, w_, l_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .l = l_, \
+    .evex = 1 \
+})
+
+#define make_evex_elem_schema(opcode_, prefix_, w_, l_, ...) \
+((instr_schema_t) { \
+    .opcode = opcode_, \
+    .args_info = ((arg_info_t[num_args(__VA_ARGS__)]) {__VA_ARGS__}), \
+    .len = num_args(__VA_ARGS__), \
+    .prefix = prefix_, \
+    .w = w_, \
+    .l = l_, \
+    .evex = 1, \
+    .disp8_elem = 1 \
+})
 
 #define make_instr_schemata(...) \
 { \
@@ -92,24 +226,925 @@ instr_schemata_t nop_schemata = make_instr_schemata(
     make_instr_schema(make_opcode(0x0f1f, 2), imm_type(ARG_SIZE_8))
 );
 
-instr_schemata_t add_schemata = make_instr_schemata(
-    make_instr_schema(make_opcode(0x04, 1), reg_type_id(ARG_SIZE_8, 0), imm_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x05, 1), reg_type_id(ARG_SIZE_16, 0), imm_type(ARG_SIZE_16)),
-    make_instr_schema(make_opcode(0x05, 1), reg_type_id(ARG_SIZE_32, 0), imm_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x05, 1), reg_type_id(ARG_SIZE_64, 0), imm_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x80, 1), memreg_type(ARG_SIZE_8), imm_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x81, 1), memreg_type(ARG_SIZE_16), imm_type(ARG_SIZE_16)),
-    make_instr_schema(make_opcode(0x81, 1), memreg_type(ARG_SIZE_32), imm_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x81, 1), memreg_type(ARG_SIZE_64), imm_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x83, 1), memreg_type(ARG_SIZE_16), imm_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x83, 1), memreg_type(ARG_SIZE_32), imm_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x83, 1), memreg_type(ARG_SIZE_64), imm_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x00, 1), memreg_type(ARG_SIZE_8), reg_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x01, 1), memreg_type(ARG_SIZE_16), reg_type(ARG_SIZE_16)),
-    make_instr_schema(make_opcode(0x01, 1), memreg_type(ARG_SIZE_32), reg_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x01, 1), memreg_type(ARG_SIZE_64), reg_type(ARG_SIZE_64)),
-    make_instr_schema(make_opcode(0x02, 1), reg_type(ARG_SIZE_8), memreg_type(ARG_SIZE_8)),
-    make_instr_schema(make_opcode(0x03, 1), reg_type(ARG_SIZE_16), memreg_type(ARG_SIZE_16)),
-    make_instr_schema(make_opcode(0x03, 1), reg_type(ARG_SIZE_32), memreg_type(ARG_SIZE_32)),
-    make_instr_schema(make_opcode(0x03, 1), reg_type(ARG_SIZE_64), memreg_type(ARG_SIZE_64))
+// The 16 (66), 32 and 64 bit (REX.W) forms of a legacy op, with the
+// operands laid out by operands_(size). Immediates are at most 32 bits
+// and sign extended for 64 bit operands.
+#define legacy_sized_forms(opcode_, digit_, operands_) \
+    make_legacy_digit_schema(opcode_, digit_, 0, 0, 1, operands_(ARG_SIZE_16)), \
+    make_legacy_digit_schema(opcode_, digit_, 0, 0, 0, operands_(ARG_SIZE_32)), \
+    make_legacy_digit_schema(opcode_, digit_, 0, 1, 0, operands_(ARG_SIZE_64))
+
+#define legacy_imm_size(size_) ((size_) == ARG_SIZE_64 ? ARG_SIZE_32 : (size_))
+
+#define legacy_acc_imm(size_) reg_type_fixed(size_, 0), imm_type_as(legacy_imm_size(size_))
+#define legacy_rm_imm(size_) memreg_type_as(size_, ARG_ROLE_RM), imm_type_as(legacy_imm_size(size_))
+#define legacy_rm_imm8(size_) memreg_type_as(size_, ARG_ROLE_RM), imm_type_as(ARG_SIZE_8)
+#define legacy_rm_cl(size_) memreg_type_as(size_, ARG_ROLE_RM), reg_type_fixed(ARG_SIZE_8, 1)
+#define legacy_rm_reg(size_) memreg_type_as(size_, ARG_ROLE_RM), reg_type_as(size_, ARG_ROLE_REG)
+#define legacy_reg_rm(size_) reg_type_as(size_, ARG_ROLE_REG), memreg_type_as(size_, ARG_ROLE_RM)
+#define legacy_rm(size_) memreg_type_as(size_, ARG_ROLE_RM)
+#define legacy_imul_imm8(size_) legacy_reg_rm(size_), imm_type_as(ARG_SIZE_8)
+#define legacy_imul_imm(size_) legacy_reg_rm(size_), imm_type_as(legacy_imm_size(size_))
+
+// Group 1 ALU ops share the 80, 81 and 83 immediate opcodes, told apart by
+// the digit, and have their register forms and accumulator short forms in
+// a row of 8 opcodes starting at row_. Signatures the register forms both
+// accept, like reg, reg, go to the earlier r/m, reg form like with gas.
+#define make_group_1_schemata(row_, digit_) make_instr_schemata( \
+    make_legacy_schema(make_opcode((row_) + 4, 1), 0, 0, 0, legacy_acc_imm(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode((row_) + 5, 1), 0, legacy_acc_imm), \
+    make_legacy_digit_schema(make_opcode(0x80, 1), digit_, 0, 0, 0, legacy_rm_imm(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode(0x81, 1), digit_, legacy_rm_imm), \
+    legacy_sized_forms(make_opcode(0x83, 1), digit_, legacy_rm_imm8), \
+    make_legacy_schema(make_opcode(row_, 1), 0, 0, 0, legacy_rm_reg(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode((row_) + 1, 1), 0, legacy_rm_reg), \
+    make_legacy_schema(make_opcode((row_) + 2, 1), 0, 0, 0, legacy_reg_rm(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode((row_) + 3, 1), 0, legacy_reg_rm) \
+)
+
+// Group 2 shifts and rotates by an immediate or by cl. The shift by one
+// opcodes D0 and D1 aren't used, an immediate of 1 takes one more byte.
+#define make_group_2_schemata(digit_) make_instr_schemata( \
+    make_legacy_digit_schema(make_opcode(0xc0, 1), digit_, 0, 0, 0, legacy_rm_imm8(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode(0xc1, 1), digit_, legacy_rm_imm8), \
+    make_legacy_digit_schema(make_opcode(0xd2, 1), digit_, 0, 0, 0, legacy_rm_cl(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode(0xd3, 1), digit_, legacy_rm_cl) \
+)
+
+// Group 3 ops on a single r/m operand. mul, imul, div and idiv take the
+// other operand and put the result in al/ax or dx:ax, edx:eax, rdx:rax.
+#define group_3_forms(digit_) \
+    make_legacy_digit_schema(make_opcode(0xf6, 1), digit_, 0, 0, 0, legacy_rm(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode(0xf7, 1), digit_, legacy_rm)
+
+#define make_group_3_schemata(digit_) make_instr_schemata(group_3_forms(digit_))
+
+instr_schemata_t add_schemata = make_group_1_schemata(0x00, 0);
+instr_schemata_t or_schemata  = make_group_1_schemata(0x08, 1);
+instr_schemata_t adc_schemata = make_group_1_schemata(0x10, 2);
+instr_schemata_t sbb_schemata = make_group_1_schemata(0x18, 3);
+instr_schemata_t and_schemata = make_group_1_schemata(0x20, 4);
+instr_schemata_t sub_schemata = make_group_1_schemata(0x28, 5);
+instr_schemata_t xor_schemata = make_group_1_schemata(0x30, 6);
+instr_schemata_t cmp_schemata = make_group_1_schemata(0x38, 7);
+
+instr_schemata_t rol_schemata = make_group_2_schemata(0);
+instr_schemata_t ror_schemata = make_group_2_schemata(1);
+instr_schemata_t rcl_schemata = make_group_2_schemata(2);
+instr_schemata_t rcr_schemata = make_group_2_schemata(3);
+instr_schemata_t shl_schemata = make_group_2_schemata(4);
+instr_schemata_t shr_schemata = make_group_2_schemata(5);
+instr_schemata_t sar_schemata = make_group_2_schemata(7);
+
+instr_schemata_t not_schemata  = make_group_3_schemata(2);
+instr_schemata_t neg_schemata  = make_group_3_schemata(3);
+instr_schemata_t mul_schemata  = make_group_3_schemata(4);
+instr_schemata_t div_schemata  = make_group_3_schemata(6);
+instr_schemata_t idiv_schemata = make_group_3_schemata(7);
+
+// imul also has two and three operand forms that keep the low half only
+instr_schemata_t imul_schemata = make_instr_schemata(
+    group_3_forms(5),
+    legacy_sized_forms(make_opcode(0x0faf, 2), 0, legacy_reg_rm),
+    legacy_sized_forms(make_opcode(0x6b, 1), 0, legacy_imul_imm8),
+    legacy_sized_forms(make_opcode(0x69, 1), 0, legacy_imul_imm)
+);
+
+// test is the group 3 /0 op with an immediate, and has register and
+// accumulator forms of its own but no sign extended imm8 form
+instr_schemata_t test_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0xa8, 1), 0, 0, 0, legacy_acc_imm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0xa9, 1), 0, legacy_acc_imm),
+    make_legacy_digit_schema(make_opcode(0xf6, 1), 0, 0, 0, 0, legacy_rm_imm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0xf7, 1), 0, legacy_rm_imm),
+    make_legacy_schema(make_opcode(0x84, 1), 0, 0, 0, legacy_rm_reg(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0x85, 1), 0, legacy_rm_reg)
+);
+
+////////////////////////////////////////////////////////////////
+
+// The condition code families are one op each, the condition operand goes
+// first and lands in the low nibble of the opcode. Jcc belongs here too
+// but is instantiated by instantiate_branch, since label resolution picks
+// its rel8 or rel32 form by the declared size of the displacement.
+#define legacy_cond_rm(size_) cond_type_as(), legacy_rm(size_)
+#define legacy_cond_reg_rm(size_) cond_type_as(), legacy_reg_rm(size_)
+
+instr_schemata_t setcc_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0x0f90, 2), 0, 0, 0, legacy_cond_rm(ARG_SIZE_8))
+);
+instr_schemata_t cmovcc_schemata = make_instr_schemata(
+    legacy_sized_forms(make_opcode(0x0f40, 2), 0, legacy_cond_reg_rm)
+);
+
+////////////////////////////////////////////////////////////////
+
+#define legacy_op_imm(size_) reg_type_as(size_, ARG_ROLE_OPCODE), imm_type_as(size_)
+
+// The register, immediate forms with the register in the opcode are the
+// shortest, and the only ones to take a full 64 bit immediate (movabs).
+// mov r/m64, imm32 sign extends and wins for the immediates that fit.
+// Only general purpose registers, the segment and control register moves
+// (8C, 8E, 0F 20, 0F 22) have no forms here.
+instr_schemata_t mov_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0x88, 1), 0, 0, 0, legacy_rm_reg(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0x89, 1), 0, legacy_rm_reg),
+    make_legacy_schema(make_opcode(0x8a, 1), 0, 0, 0, legacy_reg_rm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0x8b, 1), 0, legacy_reg_rm),
+    make_legacy_schema(make_opcode(0xb0, 1), 0, 0, 0, legacy_op_imm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0xb8, 1), 0, legacy_op_imm),
+    make_legacy_digit_schema(make_opcode(0xc6, 1), 0, 0, 0, 0, legacy_rm_imm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0xc7, 1), 0, legacy_rm_imm)
+);
+
+#define legacy_reg_rm8(size_) reg_type_as(size_, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_8, ARG_ROLE_RM)
+#define legacy_reg_rm16(size_) reg_type_as(size_, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_16, ARG_ROLE_RM)
+
+// there is no movzx from 32 bits, mov r32 already zero extends
+instr_schemata_t movzx_schemata = make_instr_schemata(
+    legacy_sized_forms(make_opcode(0x0fb6, 2), 0, legacy_reg_rm8),
+    make_legacy_schema(make_opcode(0x0fb7, 2), 0, 0, 0, legacy_reg_rm16(ARG_SIZE_32)),
+    make_legacy_schema(make_opcode(0x0fb7, 2), 0, 1, 0, legacy_reg_rm16(ARG_SIZE_64))
+);
+
+// the 32 to 64 bit form is movsxd in the manuals
+instr_schemata_t movsx_schemata = make_instr_schemata(
+    legacy_sized_forms(make_opcode(0x0fbe, 2), 0, legacy_reg_rm8),
+    make_legacy_schema(make_opcode(0x0fbf, 2), 0, 0, 0, legacy_reg_rm16(ARG_SIZE_32)),
+    make_legacy_schema(make_opcode(0x0fbf, 2), 0, 1, 0, legacy_reg_rm16(ARG_SIZE_64)),
+    make_legacy_schema(make_opcode(0x63, 1), 0, 1, 0,
+        reg_type_as(ARG_SIZE_64, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_32, ARG_ROLE_RM))
+);
+
+////////////////////////////////////////////////////////////////
+
+// inc and dec are /0 and /1 of FE and FF, the rest of group 5 are the
+// indirect branches and push
+#define make_group_5_schemata(digit_) make_instr_schemata( \
+    make_legacy_digit_schema(make_opcode(0xfe, 1), digit_, 0, 0, 0, legacy_rm(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode(0xff, 1), digit_, legacy_rm) \
+)
+
+// The r/m, reg forms of a byte op at opcode_ and its 16, 32 and 64 bit
+// forms at opcode_ + 1
+#define legacy_rm_reg_forms(opcode_, width_) \
+    make_legacy_schema(make_opcode(opcode_, width_), 0, 0, 0, legacy_rm_reg(ARG_SIZE_8)), \
+    legacy_sized_forms(make_opcode((opcode_) + 1, width_), 0, legacy_rm_reg)
+
+instr_schemata_t inc_schemata = make_group_5_schemata(0);
+instr_schemata_t dec_schemata = make_group_5_schemata(1);
+
+// The 90+r short forms are left out, xchg eax, eax would be a nop there
+// and not clear the upper half of rax. reg, reg takes the first form.
+instr_schemata_t xchg_schemata = make_instr_schemata(
+    legacy_rm_reg_forms(0x86, 1),
+    make_legacy_schema(make_opcode(0x86, 1), 0, 0, 0, legacy_reg_rm(ARG_SIZE_8)),
+    legacy_sized_forms(make_opcode(0x87, 1), 0, legacy_reg_rm)
+);
+
+// cmpxchg compares al/ax/eax/rax with the destination, cmpxchg8b and
+// cmpxchg16b compare edx:eax or rdx:rax and store ecx:ebx or rcx:rbx, the
+// 16 byte one needs an aligned operand
+instr_schemata_t xadd_schemata = make_instr_schemata(legacy_rm_reg_forms(0x0fc0, 2));
+instr_schemata_t cmpxchg_schemata = make_instr_schemata(legacy_rm_reg_forms(0x0fb0, 2));
+instr_schemata_t cmpxchg8b_schemata = make_instr_schemata(
+    make_legacy_digit_schema(make_opcode(0x0fc7, 2), 1, 0, 0, 0, mem_type_as(ARG_SIZE_64, ARG_ROLE_RM))
+);
+instr_schemata_t cmpxchg16b_schemata = make_instr_schemata(
+    make_legacy_digit_schema(make_opcode(0x0fc7, 2), 1, 0, 1, 0, mem_type_as(ARG_SIZE_128, ARG_ROLE_RM))
+);
+
+////////////////////////////////////////////////////////////////
+
+// Non-temporal stores write around the caches and are weakly ordered,
+// sfence orders them before the stores after it. They only take a memory
+// destination, movntdq one that is 16 byte aligned.
+instr_schemata_t movnti_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0x0fc3, 2), 0, 0, 0,
+        mem_type_as(ARG_SIZE_32, ARG_ROLE_RM), reg_type_as(ARG_SIZE_32, ARG_ROLE_REG)),
+    make_legacy_schema(make_opcode(0x0fc3, 2), 0, 1, 0,
+        mem_type_as(ARG_SIZE_64, ARG_ROLE_RM), reg_type_as(ARG_SIZE_64, ARG_ROLE_REG))
+);
+instr_schemata_t movntdq_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0x0fe7, 2), PREFIX_MANDATORY_66, 0, 0,
+        mem_type_as(ARG_SIZE_128, ARG_ROLE_RM), reg_type_as(ARG_SIZE_128, ARG_ROLE_REG))
+);
+
+// The prefetch hints are told apart by the digit and take a byte of the
+// line to fetch, they never fault
+#define make_prefetch_schemata(opcode_, digit_) make_instr_schemata( \
+    make_legacy_digit_schema(opcode_, digit_, 0, 0, 0, mem_type_as(ARG_SIZE_8, ARG_ROLE_RM)) \
+)
+
+instr_schemata_t prefetchnta_schemata = make_prefetch_schemata(make_opcode(0x0f18, 2), 0);
+instr_schemata_t prefetcht0_schemata = make_prefetch_schemata(make_opcode(0x0f18, 2), 1);
+instr_schemata_t prefetcht1_schemata = make_prefetch_schemata(make_opcode(0x0f18, 2), 2);
+instr_schemata_t prefetcht2_schemata = make_prefetch_schemata(make_opcode(0x0f18, 2), 3);
+// fetches the line for writing, in the exclusive state
+instr_schemata_t prefetchw_schemata = make_prefetch_schemata(make_opcode(0x0f0d, 2), 1);
+
+////////////////////////////////////////////////////////////////
+
+// reg, r/m forms of a 16, 32 and 64 bit op behind a mandatory prefix
+#define legacy_rm_forms(opcode_, prefix_) \
+    make_legacy_schema(opcode_, prefix_, 0, 1, \
+        reg_type_as(ARG_SIZE_16, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_16, ARG_ROLE_RM)), \
+    make_legacy_schema(opcode_, prefix_, 0, 0, \
+        reg_type_as(ARG_SIZE_32, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_32, ARG_ROLE_RM)), \
+    make_legacy_schema(opcode_, prefix_, 1, 0, \
+        reg_type_as(ARG_SIZE_64, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_64, ARG_ROLE_RM))
+
+instr_schemata_t popcnt_schemata = make_instr_schemata(
+    legacy_rm_forms(make_opcode(0x0fb8, 2), PREFIX_MANDATORY_F3)
+);
+instr_schemata_t lzcnt_schemata = make_instr_schemata(
+    legacy_rm_forms(make_opcode(0x0fbd, 2), PREFIX_MANDATORY_F3)
+);
+instr_schemata_t tzcnt_schemata = make_instr_schemata(
+    legacy_rm_forms(make_opcode(0x0fbc, 2), PREFIX_MANDATORY_F3)
 );
+
+// the accumulator is 32 or 64 bits, the operand size prefix and REX.W
+// describe the data operand
+instr_schemata_t crc32_schemata = make_instr_schemata(
+    make_legacy_schema(make_opcode(0x0f38f0, 3), PREFIX_MANDATORY_F2, 0, 0,
+        reg_type_as(ARG_SIZE_32, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_8, ARG_ROLE_RM)),
+    make_legacy_schema(make_opcode(0x0f38f0, 3), PREFIX_MANDATORY_F2, 1, 0,
+        reg_type_as(ARG_SIZE_64, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_8, ARG_ROLE_RM)),
+    make_legacy_schema(make_opcode(0x0f38f1, 3), PREFIX_MANDATORY_F2, 0, 1,
+        reg_type_as(ARG_SIZE_32, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_16, ARG_ROLE_RM)),
+    make_legacy_schema(make_opcode(0x0f38f1, 3), PREFIX_MANDATORY_F2, 0, 0,
+        reg_type_as(ARG_SIZE_32, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_32, ARG_ROLE_RM)),
+    make_legacy_schema(make_opcode(0x0f38f1, 3), PREFIX_MANDATORY_F2, 1, 0,
+        reg_type_as(ARG_SIZE_64, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_64, ARG_ROLE_RM))
+);
+
+// SSE4.1/4.2 integer ops on xmm, xmm/m128
+#define make_sse_rm_schemata(opcode_) make_instr_schemata( \
+    make_legacy_schema(opcode_, PREFIX_MANDATORY_66, 0, 0, \
+        reg_type_as(ARG_SIZE_128, ARG_ROLE_REG), memreg_type_as(ARG_SIZE_128, ARG_ROLE_RM)) \
+)
+
+instr_schemata_t pmulld_schemata = make_sse_rm_schemata(make_opcode(0x0f3840, 3));
+instr_schemata_t pminsd_schemata = make_sse_rm_schemata(make_opcode(0x0f3839, 3));
+instr_schemata_t pmaxsd_schemata = make_sse_rm_schemata(make_opcode(0x0f383d, 3));
+instr_schemata_t pminud_schemata = make_sse_rm_schemata(make_opcode(0x0f383b, 3));
+instr_schemata_t pmaxud_schemata = make_sse_rm_schemata(make_opcode(0x0f383f, 3));
+instr_schemata_t pcmpeqq_schemata = make_sse_rm_schemata(make_opcode(0x0f3829, 3));
+instr_schemata_t pcmpgtq_schemata = make_sse_rm_schemata(make_opcode(0x0f3837, 3));
+instr_schemata_t ptest_schemata = make_sse_rm_schemata(make_opcode(0x0f3817, 3));
+
+// element moves between xmm lanes and general purpose registers or memory,
+// the immediate selects the lane
+#define make_pextr_schemata(size_, w_) make_instr_schemata( \
+    make_legacy_schema(make_opcode(0x0f3a16, 3), PREFIX_MANDATORY_66, w_, 0, \
+        memreg_type_as(size_, ARG_ROLE_RM), reg_type_as(ARG_SIZE_128, ARG_ROLE_REG), \
+        imm_type_as(ARG_SIZE_8)) \
+)
+
+#define make_pinsr_schemata(size_, w_) make_instr_schemata( \
+    make_legacy_schema(make_opcode(0x0f3a22, 3), PREFIX_MANDATORY_66, w_, 0, \
+        reg_type_as(ARG_SIZE_128, ARG_ROLE_REG), memreg_type_as(size_, ARG_ROLE_RM), \
+        imm_type_as(ARG_SIZE_8)) \
+)
+
+instr_schemata_t pextrd_schemata = make_pextr_schemata(ARG_SIZE_32, 0);
+instr_schemata_t pextrq_schemata = make_pextr_schemata(ARG_SIZE_64, 1);
+instr_schemata_t pinsrd_schemata = make_pinsr_schemata(ARG_SIZE_32, 0);
+instr_schemata_t pinsrq_schemata = make_pinsr_schemata(ARG_SIZE_64, 1);
+
+////////////////////////////////////////////////////////////////
+
+// dest in modrm.reg, first source in VEX.vvvv, second source in modrm.rm
+#define vex_rvm(size_) \
+    reg_type_as(size_, ARG_ROLE_REG), \
+    reg_type_as(size_, ARG_ROLE_VVVV), \
+    memreg_type_as(size_, ARG_ROLE_RM)
+
+// the second source broadcast from one element in memory
+#define evex_rvm_bcst(size_, elem_size_) \
+    reg_type_as(size_, ARG_ROLE_REG), \
+    reg_type_as(size_, ARG_ROLE_VVVV), \
+    bcst_type_as(elem_size_)
+
+// the xmm (VEX.L0) and ymm (VEX.L1) forms of a three operand vector op
+#define vex_rvm_forms(opcode_, prefix_, w_) \
+    make_vex_schema(opcode_, prefix_, w_, 0, vex_rvm(ARG_SIZE_128)), \
+    make_vex_schema(opcode_, prefix_, w_, 1, vex_rvm(ARG_SIZE_256))
+
+// the xmm, ymm and zmm EVEX forms of a three operand vector op, with and
+// without broadcast
+#define evex_rvm_forms(opcode_, prefix_, w_, elem_size_) \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_128, vex_rvm(ARG_SIZE_128)), \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_256, vex_rvm(ARG_SIZE_256)), \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_512, vex_rvm(ARG_SIZE_512)), \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_128, evex_rvm_bcst(ARG_SIZE_128, elem_size_)), \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_256, evex_rvm_bcst(ARG_SIZE_256, elem_size_)), \
+    make_evex_schema(opcode_, prefix_, w_, PREFIX_EVEX_SIZE_512, evex_rvm_bcst(ARG_SIZE_512, elem_size_))
+
+// vector ops that AVX-512 extends to zmm under the same name, so the
+// VEX forms have to come first to win the xmm and ymm signatures
+#define make_vex_evex_rvm_schemata(opcode_, vex_w_, evex_w_, elem_size_) make_instr_schemata( \
+    vex_rvm_forms(opcode_, PREFIX_VEX_IMPLICIT_66, vex_w_), \
+    evex_rvm_forms(opcode_, PREFIX_VEX_IMPLICIT_66, evex_w_, elem_size_) \
+)
+
+#define make_evex_rvm_schemata(opcode_, w_, elem_size_) make_instr_schemata( \
+    evex_rvm_forms(opcode_, PREFIX_VEX_IMPLICIT_66, w_, elem_size_) \
+)
+
+// the source is always an xmm register or an element sized memory operand
+#define broadcast_forms(make_schema_, opcode_, w_, l_, size_, mem_size_) \
+    make_schema_(opcode_, PREFIX_VEX_IMPLICIT_66, w_, l_, \
+        reg_type_as(size_, ARG_ROLE_REG), reg_type_as(ARG_SIZE_128, ARG_ROLE_RM)), \
+    make_schema_(opcode_, PREFIX_VEX_IMPLICIT_66, w_, l_, \
+        reg_type_as(size_, ARG_ROLE_REG), mem_type_as(mem_size_, ARG_ROLE_RM))
+
+#define make_vex_broadcast_schemata(opcode_, mem_size_) make_instr_schemata( \
+    broadcast_forms(make_vex_schema, opcode_, 0, 0, ARG_SIZE_128, mem_size_), \
+    broadcast_forms(make_vex_schema, opcode_, 0, 1, ARG_SIZE_256, mem_size_) \
+)
+
+#define make_vex_evex_broadcast_schemata(opcode_, evex_w_, mem_size_) make_instr_schemata( \
+    broadcast_forms(make_vex_schema, opcode_, 0, 0, ARG_SIZE_128, mem_size_), \
+    broadcast_forms(make_vex_schema, opcode_, 0, 1, ARG_SIZE_256, mem_size_), \
+    broadcast_forms(make_evex_schema, opcode_, evex_w_, PREFIX_EVEX_SIZE_128, ARG_SIZE_128, mem_size_), \
+    broadcast_forms(make_evex_schema, opcode_, evex_w_, PREFIX_EVEX_SIZE_256, ARG_SIZE_256, mem_size_), \
+    broadcast_forms(make_evex_schema, opcode_, evex_w_, PREFIX_EVEX_SIZE_512, ARG_SIZE_512, mem_size_) \
+)
+
+instr_schemata_t vpaddd_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0ffe, 2), 0, 0, ARG_SIZE_32);
+instr_schemata_t vpaddq_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0fd4, 2), 0, 1, ARG_SIZE_64);
+instr_schemata_t vpand_schemata = make_instr_schemata(
+    vex_rvm_forms(make_opcode(0x0fdb, 2), PREFIX_VEX_IMPLICIT_66, 0)
+);
+instr_schemata_t vpxor_schemata = make_instr_schemata(
+    vex_rvm_forms(make_opcode(0x0fef, 2), PREFIX_VEX_IMPLICIT_66, 0)
+);
+
+// AVX-512 splits the bitwise ops by element size, which matters for
+// masking and broadcast
+instr_schemata_t vpandd_schemata = make_evex_rvm_schemata(make_opcode(0x0fdb, 2), 0, ARG_SIZE_32);
+instr_schemata_t vpandq_schemata = make_evex_rvm_schemata(make_opcode(0x0fdb, 2), 1, ARG_SIZE_64);
+instr_schemata_t vpxord_schemata = make_evex_rvm_schemata(make_opcode(0x0fef, 2), 0, ARG_SIZE_32);
+instr_schemata_t vpxorq_schemata = make_evex_rvm_schemata(make_opcode(0x0fef, 2), 1, ARG_SIZE_64);
+
+#define vmovdqu_forms(make_schema_, prefix_, w_, l_, size_) \
+    make_schema_(make_opcode(0x0f6f, 2), prefix_, w_, l_, \
+        reg_type_as(size_, ARG_ROLE_REG), memreg_type_as(size_, ARG_ROLE_RM)), \
+    make_schema_(make_opcode(0x0f7f, 2), prefix_, w_, l_, \
+        mem_type_as(size_, ARG_ROLE_RM), reg_type_as(size_, ARG_ROLE_REG))
+
+instr_schemata_t vmovdqu_schemata = make_instr_schemata(
+    vmovdqu_forms(make_vex_schema, PREFIX_VEX_IMPLICIT_F3, 0, 0, ARG_SIZE_128),
+    vmovdqu_forms(make_vex_schema, PREFIX_VEX_IMPLICIT_F3, 0, 1, ARG_SIZE_256)
+);
+
+// like movntdq, the destination has to be aligned to the vector size
+instr_schemata_t vmovntdq_schemata = make_instr_schemata(
+    make_vex_schema(make_opcode(0x0fe7, 2), PREFIX_VEX_IMPLICIT_66, 0, 0,
+        mem_type_as(ARG_SIZE_128, ARG_ROLE_RM), reg_type_as(ARG_SIZE_128, ARG_ROLE_REG)),
+    make_vex_schema(make_opcode(0x0fe7, 2), PREFIX_VEX_IMPLICIT_66, 0, 1,
+        mem_type_as(ARG_SIZE_256, ARG_ROLE_RM), reg_type_as(ARG_SIZE_256, ARG_ROLE_REG))
+);
+
+#define make_vmovdqu_evex_schemata(w_) make_instr_schemata( \
+    vmovdqu_forms(make_evex_schema, PREFIX_VEX_IMPLICIT_F3, w_, PREFIX_EVEX_SIZE_128, ARG_SIZE_128), \
+    vmovdqu_forms(make_evex_schema, PREFIX_VEX_IMPLICIT_F3, w_, PREFIX_EVEX_SIZE_256, ARG_SIZE_256), \
+    vmovdqu_forms(make_evex_schema, PREFIX_VEX_IMPLICIT_F3, w_, PREFIX_EVEX_SIZE_512, ARG_SIZE_512) \
+)
+
+instr_schemata_t vmovdqu32_schemata = make_vmovdqu_evex_schemata(0);
+instr_schemata_t vmovdqu64_schemata = make_vmovdqu_evex_schemata(1);
+
+instr_schemata_t vpbroadcastb_schemata = make_vex_broadcast_schemata(make_opcode(0x0f3878, 3), ARG_SIZE_8);
+instr_schemata_t vpbroadcastw_schemata = make_vex_broadcast_schemata(make_opcode(0x0f3879, 3), ARG_SIZE_16);
+instr_schemata_t vpbroadcastd_schemata = make_vex_evex_broadcast_schemata(make_opcode(0x0f3858, 3), 0, ARG_SIZE_32);
+instr_schemata_t vpbroadcastq_schemata = make_vex_evex_broadcast_schemata(make_opcode(0x0f3859, 3), 1, ARG_SIZE_64);
+
+// crosses lanes, so there is no xmm form
+instr_schemata_t vpermd_schemata = make_instr_schemata(
+    make_vex_schema(make_opcode(0x0f3836, 3), PREFIX_VEX_IMPLICIT_66, 0, 1, vex_rvm(ARG_SIZE_256)),
+    make_evex_schema(make_opcode(0x0f3836, 3), PREFIX_VEX_IMPLICIT_66, 0, PREFIX_EVEX_SIZE_256,
+        vex_rvm(ARG_SIZE_256)),
+    make_evex_schema(make_opcode(0x0f3836, 3), PREFIX_VEX_IMPLICIT_66, 0, PREFIX_EVEX_SIZE_512,
+        vex_rvm(ARG_SIZE_512)),
+    make_evex_schema(make_opcode(0x0f3836, 3), PREFIX_VEX_IMPLICIT_66, 0, PREFIX_EVEX_SIZE_256,
+        evex_rvm_bcst(ARG_SIZE_256, ARG_SIZE_32)),
+    make_evex_schema(make_opcode(0x0f3836, 3), PREFIX_VEX_IMPLICIT_66, 0, PREFIX_EVEX_SIZE_512,
+        evex_rvm_bcst(ARG_SIZE_512, ARG_SIZE_32))
+);
+
+// FMA3 ops are named after the order the operands are multiplied and
+// added in, 213 being dest = vvvv * dest + rm. W selects double precision.
+instr_schemata_t vfmadd132ps_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f3898, 3), 0, 0, ARG_SIZE_32);
+instr_schemata_t vfmadd213ps_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f38a8, 3), 0, 0, ARG_SIZE_32);
+instr_schemata_t vfmadd231ps_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f38b8, 3), 0, 0, ARG_SIZE_32);
+instr_schemata_t vfmadd132pd_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f3898, 3), 1, 1, ARG_SIZE_64);
+instr_schemata_t vfmadd213pd_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f38a8, 3), 1, 1, ARG_SIZE_64);
+instr_schemata_t vfmadd231pd_schemata = make_vex_evex_rvm_schemata(make_opcode(0x0f38b8, 3), 1, 1, ARG_SIZE_64);
+
+// the EVEX forms compare into an opmask register instead of a vector
+#define vpcmp_evex_forms(opcode_, l_, size_) \
+    make_evex_schema(opcode_, PREFIX_VEX_IMPLICIT_66, 0, l_, \
+        mask_type_as(ARG_ROLE_REG), \
+        reg_type_as(size_, ARG_ROLE_VVVV), \
+        memreg_type_as(size_, ARG_ROLE_RM)), \
+    make_evex_schema(opcode_, PREFIX_VEX_IMPLICIT_66, 0, l_, \
+        mask_type_as(ARG_ROLE_REG), \
+        reg_type_as(size_, ARG_ROLE_VVVV), \
+        bcst_type_as(ARG_SIZE_32))
+
+#define make_vpcmp_schemata(opcode_) make_instr_schemata( \
+    vex_rvm_forms(opcode_, PREFIX_VEX_IMPLICIT_66, 0), \
+    vpcmp_evex_forms(opcode_, PREFIX_EVEX_SIZE_128, ARG_SIZE_128), \
+    vpcmp_evex_forms(opcode_, PREFIX_EVEX_SIZE_256, ARG_SIZE_256), \
+    vpcmp_evex_forms(opcode_, PREFIX_EVEX_SIZE_512, ARG_SIZE_512) \
+)
+
+instr_schemata_t vpcmpeqd_schemata = make_vpcmp_schemata(make_opcode(0x0f76, 2));
+instr_schemata_t vpcmpgtd_schemata = make_vpcmp_schemata(make_opcode(0x0f66, 2));
+
+// Compress stores the elements selected by the mask contiguously, expand
+// loads contiguous elements into the selected positions. Their memory
+// operands are as wide as the vector, but disp8 scales by one element.
+#define compress_forms(opcode_, w_, l_, size_) \
+    make_evex_elem_schema(opcode_, PREFIX_VEX_IMPLICIT_66, w_, l_, \
+        memreg_type_as(size_, ARG_ROLE_RM), reg_type_as(size_, ARG_ROLE_REG))
+
+#define expand_forms(opcode_, w_, l_, size_) \
+    make_evex_elem_schema(opcode_, PREFIX_VEX_IMPLICIT_66, w_, l_, \
+        reg_type_as(size_, ARG_ROLE_REG), memreg_type_as(size_, ARG_ROLE_RM))
+
+#define make_compress_schemata(forms_, opcode_, w_) make_instr_schemata( \
+    forms_(opcode_, w_, PREFIX_EVEX_SIZE_128, ARG_SIZE_128), \
+    forms_(opcode_, w_, PREFIX_EVEX_SIZE_256, ARG_SIZE_256), \
+    forms_(opcode_, w_, PREFIX_EVEX_SIZE_512, ARG_SIZE_512) \
+)
+
+instr_schemata_t vpcompressd_schemata = make_compress_schemata(compress_forms, make_opcode(0x0f388b, 3), 0);
+instr_schemata_t vpcompressq_schemata = make_compress_schemata(compress_forms, make_opcode(0x0f388b, 3), 1);
+instr_schemata_t vpexpandd_schemata = make_compress_schemata(expand_forms, make_opcode(0x0f3889, 3), 0);
+instr_schemata_t vpexpandq_schemata = make_compress_schemata(expand_forms, make_opcode(0x0f3889, 3), 1);
+
+// kmovw moves the low 16 bits of an opmask register
+instr_schemata_t kmovw_schemata = make_instr_schemata(
+    make_vex_schema(make_opcode(0x0f90, 2), 0, 0, 0,
+        mask_type_as(ARG_ROLE_REG), mask_type_as(ARG_ROLE_RM)),
+    make_vex_schema(make_opcode(0x0f90, 2), 0, 0, 0,
+        mask_type_as(ARG_ROLE_REG), mem_type_as(ARG_SIZE_16, ARG_ROLE_RM)),
+    make_vex_schema(make_opcode(0x0f91, 2), 0, 0, 0,
+        mem_type_as(ARG_SIZE_16, ARG_ROLE_RM), mask_type_as(ARG_ROLE_REG)),
+    make_vex_schema(make_opcode(0x0f92, 2), 0, 0, 0,
+        mask_type_as(ARG_ROLE_REG), reg_type_as(ARG_SIZE_32, ARG_ROLE_RM)),
+    make_vex_schema(make_opcode(0x0f93, 2), 0, 0, 0,
+        reg_type_as(ARG_SIZE_32, ARG_ROLE_REG), mask_type_as(ARG_ROLE_RM))
+);
+
+////////////////////////////////////////////////////////////////
+
+// BMI1/BMI2 ops take general purpose registers in every VEX operand field,
+// W selects the 64 bit form and L is always 0.
+#define make_gpr_vex_schemata(operands_, opcode_, prefix_) make_instr_schemata( \
+    make_vex_schema(opcode_, prefix_, 0, 0, operands_(ARG_SIZE_32)), \
+    make_vex_schema(opcode_, prefix_, 1, 0, operands_(ARG_SIZE_64)) \
+)
+
+// dest in modrm.reg, source in modrm.rm, count or index in VEX.vvvv
+#define vex_rmv(size_) \
+    reg_type_as(size_, ARG_ROLE_REG), \
+    memreg_type_as(size_, ARG_ROLE_RM), \
+    reg_type_as(size_, ARG_ROLE_VVVV)
+
+#define vex_rmi(size_) \
+    reg_type_as(size_, ARG_ROLE_REG), \
+    memreg_type_as(size_, ARG_ROLE_RM), \
+    imm_type_as(ARG_SIZE_8)
+
+// dest in VEX.vvvv, modrm.reg holds the opcode extension
+#define vex_vm(size_) \
+    reg_type_as(size_, ARG_ROLE_VVVV), \
+    memreg_type_as(size_, ARG_ROLE_RM)
+
+instr_schemata_t shlx_schemata = make_gpr_vex_schemata(vex_rmv, make_opcode(0x0f38f7, 3), PREFIX_VEX_IMPLICIT_66);
+instr_schemata_t sarx_schemata = make_gpr_vex_schemata(vex_rmv, make_opcode(0x0f38f7, 3), PREFIX_VEX_IMPLICIT_F3);
+instr_schemata_t shrx_schemata = make_gpr_vex_schemata(vex_rmv, make_opcode(0x0f38f7, 3), PREFIX_VEX_IMPLICIT_F2);
+instr_schemata_t rorx_schemata = make_gpr_vex_schemata(vex_rmi, make_opcode(0x0f3af0, 3), PREFIX_VEX_IMPLICIT_F2);
+instr_schemata_t bzhi_schemata = make_gpr_vex_schemata(vex_rmv, make_opcode(0x0f38f5, 3), 0);
+instr_schemata_t pdep_schemata = make_gpr_vex_schemata(vex_rvm, make_opcode(0x0f38f5, 3), PREFIX_VEX_IMPLICIT_F2);
+instr_schemata_t pext_schemata = make_gpr_vex_schemata(vex_rvm, make_opcode(0x0f38f5, 3), PREFIX_VEX_IMPLICIT_F3);
+instr_schemata_t andn_schemata = make_gpr_vex_schemata(vex_rvm, make_opcode(0x0f38f2, 3), 0);
+// the high half goes to modrm.reg and the low half to VEX.vvvv, the other
+// factor is always edx or rdx
+instr_schemata_t mulx_schemata = make_gpr_vex_schemata(vex_rvm, make_opcode(0x0f38f6, 3), PREFIX_VEX_IMPLICIT_F2);
+instr_schemata_t blsr_schemata = make_instr_schemata(
+    make_vex_digit_schema(make_opcode(0x0f38f3, 3), 1, 0, 0, 0, vex_vm(ARG_SIZE_32)),
+    make_vex_digit_schema(make_opcode(0x0f38f3, 3), 1, 0, 1, 0, vex_vm(ARG_SIZE_64))
+);
+
+////////////////////////////////////////////////////////////////
+
+instr_schemata_t* op_schemata[] = {
+    [OP_SETCC] = &setcc_schemata,
+    [OP_CMOVCC] = &cmovcc_schemata,
+    [OP_ADD] = &add_schemata,
+    [OP_OR] = &or_schemata,
+    [OP_ADC] = &adc_schemata,
+    [OP_SBB] = &sbb_schemata,
+    [OP_AND] = &and_schemata,
+    [OP_SUB] = &sub_schemata,
+    [OP_XOR] = &xor_schemata,
+    [OP_CMP] = &cmp_schemata,
+    [OP_ROL] = &rol_schemata,
+    [OP_ROR] = &ror_schemata,
+    [OP_RCL] = &rcl_schemata,
+    [OP_RCR] = &rcr_schemata,
+    [OP_SHL] = &shl_schemata,
+    [OP_SHR] = &shr_schemata,
+    [OP_SAR] = &sar_schemata,
+    [OP_NOT] = &not_schemata,
+    [OP_NEG] = &neg_schemata,
+    [OP_MUL] = &mul_schemata,
+    [OP_IMUL] = &imul_schemata,
+    [OP_DIV] = &div_schemata,
+    [OP_IDIV] = &idiv_schemata,
+    [OP_TEST] = &test_schemata,
+    [OP_MOV] = &mov_schemata,
+    [OP_MOVZX] = &movzx_schemata,
+    [OP_MOVSX] = &movsx_schemata,
+    [OP_INC] = &inc_schemata,
+    [OP_DEC] = &dec_schemata,
+    [OP_XCHG] = &xchg_schemata,
+    [OP_XADD] = &xadd_schemata,
+    [OP_CMPXCHG] = &cmpxchg_schemata,
+    [OP_CMPXCHG8B] = &cmpxchg8b_schemata,
+    [OP_CMPXCHG16B] = &cmpxchg16b_schemata,
+    [OP_MOVNTI] = &movnti_schemata,
+    [OP_MOVNTDQ] = &movntdq_schemata,
+    [OP_PREFETCHT0] = &prefetcht0_schemata,
+    [OP_PREFETCHT1] = &prefetcht1_schemata,
+    [OP_PREFETCHT2] = &prefetcht2_schemata,
+    [OP_PREFETCHNTA] = &prefetchnta_schemata,
+    [OP_PREFETCHW] = &prefetchw_schemata,
+    [OP_POPCNT] = &popcnt_schemata,
+    [OP_LZCNT] = &lzcnt_schemata,
+    [OP_TZCNT] = &tzcnt_schemata,
+    [OP_CRC32] = &crc32_schemata,
+    [OP_PMULLD] = &pmulld_schemata,
+    [OP_PMINSD] = &pminsd_schemata,
+    [OP_PMAXSD] = &pmaxsd_schemata,
+    [OP_PMINUD] = &pminud_schemata,
+    [OP_PMAXUD] = &pmaxud_schemata,
+    [OP_PCMPEQQ] = &pcmpeqq_schemata,
+    [OP_PCMPGTQ] = &pcmpgtq_schemata,
+    [OP_PTEST] = &ptest_schemata,
+    [OP_PEXTRD] = &pextrd_schemata,
+    [OP_PEXTRQ] = &pextrq_schemata,
+    [OP_PINSRD] = &pinsrd_schemata,
+    [OP_PINSRQ] = &pinsrq_schemata,
+    [OP_VPADDD] = &vpaddd_schemata,
+    [OP_VPADDQ] = &vpaddq_schemata,
+    [OP_VPAND] = &vpand_schemata,
+    [OP_VPXOR] = &vpxor_schemata,
+    [OP_VMOVDQU] = &vmovdqu_schemata,
+    [OP_VMOVNTDQ] = &vmovntdq_schemata,
+    [OP_VPBROADCASTB] = &vpbroadcastb_schemata,
+    [OP_VPBROADCASTW] = &vpbroadcastw_schemata,
+    [OP_VPBROADCASTD] = &vpbroadcastd_schemata,
+    [OP_VPBROADCASTQ] = &vpbroadcastq_schemata,
+    [OP_VPERMD] = &vpermd_schemata,
+    [OP_VFMADD132PS] = &vfmadd132ps_schemata,
+    [OP_VFMADD213PS] = &vfmadd213ps_schemata,
+    [OP_VFMADD231PS] = &vfmadd231ps_schemata,
+    [OP_VFMADD132PD] = &vfmadd132pd_schemata,
+    [OP_VFMADD213PD] = &vfmadd213pd_schemata,
+    [OP_VFMADD231PD] = &vfmadd231pd_schemata,
+    [OP_SHLX] = &shlx_schemata,
+    [OP_SARX] = &sarx_schemata,
+    [OP_SHRX] = &shrx_schemata,
+    [OP_RORX] = &rorx_schemata,
+    [OP_BZHI] = &bzhi_schemata,
+    [OP_PDEP] = &pdep_schemata,
+    [OP_PEXT] = &pext_schemata,
+    [OP_ANDN] = &andn_schemata,
+    [OP_BLSR] = &blsr_schemata,
+    [OP_MULX] = &mulx_schemata,
+    [OP_VPANDD] = &vpandd_schemata,
+    [OP_VPANDQ] = &vpandq_schemata,
+    [OP_VPXORD] = &vpxord_schemata,
+    [OP_VPXORQ] = &vpxorq_schemata,
+    [OP_VMOVDQU32] = &vmovdqu32_schemata,
+    [OP_VMOVDQU64] = &vmovdqu64_schemata,
+    [OP_VPCMPEQD] = &vpcmpeqd_schemata,
+    [OP_VPCMPGTD] = &vpcmpgtd_schemata,
+    [OP_VPCOMPRESSD] = &vpcompressd_schemata,
+    [OP_VPCOMPRESSQ] = &vpcompressq_schemata,
+    [OP_VPEXPANDD] = &vpexpandd_schemata,
+    [OP_VPEXPANDQ] = &vpexpandq_schemata,
+    [OP_KMOVW] = &kmovw_schemata,
+};
+
+#define num_ops (sizeof(op_schemata) / sizeof(op_schemata[0]))
+
+////////////////////////////////////////////////////////////////
+
+// Every schema is expanded into the concrete operand signatures it accepts
+// and stored in one open addressed hash table keyed by the op and the
+// signature, so finding the schema for an instruction costs one key
+// computation and usually a single probe. Signatures that several schemata
+// accept keep the one with the shortest encoding, see schema_cost.
+//
+// Immediates are keyed by the smallest size their value sign extends from
+// rather than the size the caller gave them, and an imm_type(size) schema
+// accepts every immediate that fits in size. That is what lets ADD(RAX,
+// imm_32(1)) pick the 0x83 /0 ib form.
+//
+// key layout: the EVEX bit, op in the next 12 bits, then the argument count
+// in 3 bits, then 12 bits of (type, size, reg id class) for each of up to 4
+// arguments. Only register ids that some schema asks for by name get a
+// class of their own, all other ids share SCHEMA_ID_CLASS_ANY, which keeps
+// the table small. Register operands are keyed by their register class in
+// place of the type, in the type values from 8 up that no tag uses, so a
+// k-reg or a segment register never lands on a slot for a general purpose
+// register of the same size.
+//
+// Instructions with a trailing write mask or a register above 15 can only
+// be EVEX encoded and set the EVEX bit. EVEX schemata are entered under
+// their key both with and without the bit, and without it they lose to a
+// VEX schema for the same signature, see schema_cost.
+
+#define SCHEMA_KEY_MAX_ARGS 4
+
+#define SCHEMA_KEY_EVEX (1ull << 63)
+
+#define schema_key_arg(type, size, id) \
+    ((uint64_t) ((((type) & 0xf) << 8) | (((size) & 0xf) << 4) | ((id) & 0xf)))
+
+#define SCHEMA_KEY_TYPE_REG_CLASS 8
+
+#define schema_key_type(type, reg_class) \
+    ((type) == ARG_TYPE_REG ? SCHEMA_KEY_TYPE_REG_CLASS + (reg_class) : (type))
+
+#define schema_key_head(op, len) (((uint64_t) (op) << 51) | ((uint64_t) (len) << 48))
+
+// operands that make up the signature, a write mask goes last and isn't one
+#define schema_key_len(instr) \
+    ((instr).len - ((instr).len && arg_is_mask((instr).args[(instr).len - 1])))
+
+typedef struct {
+    uint64_t key;
+    instr_schema_t* schema;
+} schema_dispatch_entry_t;
+
+typedef struct {
+    schema_dispatch_entry_t* entries;
+    uint32_t mask;
+    uint8_t shift;
+    uint8_t id_class[32];
+} schema_dispatch_t;
+
+#define SCHEMA_ID_CLASS_ANY 0xf
+
+schema_dispatch_t schema_dispatch;
+
+static inline uint32_t schema_key_slot(uint64_t key) {
+    return (key * 0x9e3779b97f4a7c15) >> schema_dispatch.shift;
+}
+
+static inline uint64_t schema_key(instr_t instr) {
+    uint8_t len = schema_key_len(instr);
+    uint64_t key = schema_key_head(instr.op, len);
+    if (len != instr.len) {
+        key |= SCHEMA_KEY_EVEX;
+    }
+    for (int i = 0; i < len; i++) {
+        arg_t arg = instr.args[i];
+        uint8_t id = 0;
+        uint8_t size = arg_size(arg);
+        uint8_t reg_class = 0;
+        if (arg_is_reg(arg)) {
+            reg_class = register_class(arg_to_reg(arg));
+            id = schema_dispatch.id_class[register_id(arg_to_reg(arg))];
+            if (register_id_ext(arg_to_reg(arg))) {
+                key |= SCHEMA_KEY_EVEX;
+            }
+        }
+        if (arg_is_imm(arg)) {
+            size = immediate_min_size(arg_to_imm(arg));
+        }
+        key |= schema_key_arg(schema_key_type(arg_type(arg), reg_class), size, id) << (12 * i);
+    }
+    return key;
+}
+
+static inline instr_schema_t* lookup_schema(instr_t instr) {
+    if (schema_key_len(instr) > SCHEMA_KEY_MAX_ARGS || !schema_dispatch.entries) {
+        return NULL;
+    }
+    uint64_t key = schema_key(instr);
+    uint32_t slot = schema_key_slot(key);
+    for (;; slot = (slot + 1) & schema_dispatch.mask) {
+        schema_dispatch_entry_t entry = schema_dispatch.entries[slot];
+        if (entry.key == key || !entry.schema) {
+            return entry.schema;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////
+
+// concrete (type, size, id) triples one schema argument accepts
+static inline uint32_t schema_arg_expand(arg_info_t arg_info,
+                                         uint64_t*  out) {
+    uint8_t types[3];
+    uint8_t types_len = 0;
+    switch (arg_info_type(arg_info)) {
+    case ARG_TYPE_ANY:
+        types[types_len++] = ARG_TYPE_REG;
+        types[types_len++] = ARG_TYPE_MEM;
+        types[types_len++] = ARG_TYPE_IMM;
+        break;
+    case ARG_TYPE_MEMREG:
+        types[types_len++] = ARG_TYPE_REG;
+        types[types_len++] = ARG_TYPE_MEM;
+        break;
+    default:
+        types[types_len++] = arg_info_type(arg_info);
+        break;
+    }
+
+    uint8_t size_min = arg_info_size(arg_info);
+    uint8_t size_max = arg_info_size(arg_info);
+    if (size_min == ARG_SIZE_ANY) {
+        size_min = ARG_SIZE_8;
+        size_max = ARG_SIZE_80;
+    }
+
+    uint32_t len = 0;
+    for (int t = 0; t < types_len; t++) {
+        if (types[t] == ARG_TYPE_IMM && size_min <= ARG_SIZE_64) {
+            size_min = ARG_SIZE_8;
+        }
+        uint8_t type = schema_key_type(types[t], arg_info_reg_class(arg_info));
+        for (uint8_t size = size_min; size <= size_max; size++) {
+            if (types[t] != ARG_TYPE_REG) {
+                out[len++] = schema_key_arg(type, size, 0);
+            }
+            else if (arg_info_id(arg_info) != (uint8_t) -1) {
+                out[len++] = schema_key_arg(type, size, arg_info_id(arg_info));
+            }
+            else {
+                for (uint8_t id = 0; id < 16; id++) {
+                    if (schema_dispatch.id_class[id] == id) {
+                        out[len++] = schema_key_arg(type, size, id);
+                    }
+                }
+                out[len++] = schema_key_arg(type, size, SCHEMA_ID_CLASS_ANY);
+            }
+        }
+    }
+    return len;
+}
+
+#define SCHEMA_ARG_EXPAND_MAX (3 * 16 * ARG_SIZE_80)
+
+// Bytes a schema contributes on top of what the operands cost in any form
+// (prefixes, sib and displacement), scaled so that ties go to the narrower
+// immediate. Registers fixed by the schema or added to the opcode need no
+// modrm byte. The EVEX prefix is longer than any VEX prefix.
+static inline uint32_t schema_cost(instr_schema_t* schema) {
+    uint32_t len = schema->opcode.len + schema->evex;
+    uint32_t imm = 0;
+    bool modrm = false;
+    for (int i = 0; i < schema->len; i++) {
+        arg_info_t arg_info = schema->args_info[i];
+        switch (arg_info_type(arg_info)) {
+        case ARG_TYPE_IMM:
+            imm = arg_size_bytes(arg_info_size(arg_info));
+            break;
+        case ARG_TYPE_REG:
+            modrm |= arg_info_id(arg_info) == (uint8_t) -1 &&
+                     arg_info_role(arg_info) != ARG_ROLE_OPCODE;
+            break;
+        case ARG_TYPE_MEM:
+        case ARG_TYPE_MEMREG:
+            modrm = true;
+            break;
+        }
+    }
+    return (len + modrm + imm) * 16 + imm;
+}
+
+static inline void schema_dispatch_insert(uint64_t key, instr_schema_t* schema) {
+    uint32_t slot = schema_key_slot(key);
+    for (;; slot = (slot + 1) & schema_dispatch.mask) {
+        schema_dispatch_entry_t* entry = &schema_dispatch.entries[slot];
+        if (!entry->schema) {
+            *entry = (schema_dispatch_entry_t) {.key = key, .schema = schema};
+            return;
+        }
+        if (entry->key == key) {
+            // on equal cost the earlier schema stays
+            if (schema_cost(schema) < schema_cost(entry->schema)) {
+                entry->schema = schema;
+            }
+            return;
+        }
+    }
+}
+
+// calls fn(key, schema) for every concrete signature, in schema order
+static inline uint64_t schema_dispatch_walk(void (*fn)(uint64_t, instr_schema_t*)) {
+    static uint64_t expanded[SCHEMA_KEY_MAX_ARGS][SCHEMA_ARG_EXPAND_MAX];
+    uint64_t count = 0;
+
+    for (uint32_t op = 0; op < num_ops; op++) {
+        instr_schemata_t* schemata = op_schemata[op];
+        if (!schemata) {
+            continue;
+        }
+        for (uint32_t i = 0; i < schemata->len; i++) {
+            instr_schema_t* schema = &schemata->schemata[i];
+            if (schema->len > SCHEMA_KEY_MAX_ARGS) {
+                continue;
+            }
+
+            uint32_t lens[SCHEMA_KEY_MAX_ARGS];
+            uint32_t at[SCHEMA_KEY_MAX_ARGS] = {0};
+            for (int j = 0; j < schema->len; j++) {
+                lens[j] = schema_arg_expand(schema->args_info[j], expanded[j]);
+            }
+
+            // odometer over the cartesian product of the argument expansions
+            for (;;) {
+                uint64_t key = schema_key_head(op, schema->len);
+                for (int j = 0; j < schema->len; j++) {
+                    key |= expanded[j][at[j]] << (12 * j);
+                }
+                if (fn) {
+                    fn(key, schema);
+                }
+                count++;
+                if (schema->evex) {
+                    if (fn) {
+                        fn(key | SCHEMA_KEY_EVEX, schema);
+                    }
+                    count++;
+                }
+
+                int j = 0;
+                for (; j < schema->len; j++) {
+                    if (++at[j] < lens[j]) {
+                        break;
+                    }
+                    at[j] = 0;
+                }
+                if (j == schema->len) {
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+__attribute__((constructor))
+static void schema_dispatch_build(void) {
+    memset(schema_dispatch.id_class, SCHEMA_ID_CLASS_ANY, 32);
+    for (uint32_t op = 0; op < num_ops; op++) {
+        instr_schemata_t* schemata = op_schemata[op];
+        for (uint32_t i = 0; schemata && i < schemata->len; i++) {
+            instr_schema_t schema = schemata->schemata[i];
+            for (int j = 0; j < schema.len; j++) {
+                uint8_t id = arg_info_id(schema.args_info[j]);
+                if (arg_info_type(schema.args_info[j]) == ARG_TYPE_REG &&
+                    id < SCHEMA_ID_CLASS_ANY) {
+                    schema_dispatch.id_class[id] = id;
+                }
+            }
+        }
+    }
+
+    uint64_t count = schema_dispatch_walk(NULL);
+
+    uint8_t bits = 4;
+    while ((1ull << bits) < 2 * count) {
+        bits++;
+    }
+    void* entries = mmap(
+        0, (1ull << bits) * sizeof(schema_dispatch_entry_t),
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    // without a table lookup_schema finds nothing and every schema driven
+    // instruction fails to instantiate
+    if (entries == MAP_FAILED) {
+        return;
+    }
+    schema_dispatch.entries = entries;
+    schema_dispatch.mask = (1u << bits) - 1;
+    schema_dispatch.shift = 64 - bits;
+
+    schema_dispatch_walk(schema_dispatch_insert);
+}
@@ -5,52 +5,61 @@
 #include "instruction_schemata.h"
 #include "instruction_encoding_legacy.c"
 #include "instruction_encoding_vex.c"
+#include "instruction_encoding_evex.c"
 
 ////////////////////////////////////////////////////////////////
 
-static inline void write_opcode(buffer_t* buf, instr_instance_t instance);
-static inline void write_disp(buffer_t* buf, instr_instance_t instance);
-static inline void write_imm(buffer_t* buf, instr_instance_t instance);
-static inline void write_modrm_sib(buffer_t* buf, instr_instance_t instance);
+static inline void write_opcode(staging_t* stage, instr_instance_t instance);
+static inline void write_disp(staging_t* stage, instr_instance_t instance);
+static inline void write_imm(staging_t* stage, instr_instance_t instance);
+static inline void write_modrm_sib(staging_t* stage, instr_instance_t instance);
+static inline uint64_t instruction_length_at(instr_instance_t instance,
+                                             uint64_t         offset);
+static inline uint64_t instruction_length(instr_instance_t instance);
+static inline void stage_instruction_instance(staging_t*       stage,
+                                              instr_instance_t instance);
+static inline void write_nops(buffer_t* buf, uint64_t nop_length);
 
-static inline void write_legacy_instance(buffer_t*        buf,
+static inline void write_legacy_instance(staging_t*       stage,
                                          instr_instance_t instance) {
-    switch (prefix_group_1(instance)) {
-    case PREFIX_LOCK:
-        buf_write_8(buf, 0xf0);
-        break;
-    case PREFIX_REPNZ:
-        buf_write_8(buf, 0xf2);
-        break;
-    case PREFIX_REPZ:
-        buf_write_8(buf, 0xf3);
-        break;
+    if (prefix_group_1(instance) == PREFIX_LOCK) {
+        stage_write_8(stage, 0xf0);
     }
     switch (prefix_group_2(instance)) {
     case PREFIX_OVERRIDE_CS:
-        buf_write_8(buf, 0x2e);
+        stage_write_8(stage, 0x2e);
         break;
     case PREFIX_OVERRIDE_SS:
-        buf_write_8(buf, 0x36);
+        stage_write_8(stage, 0x36);
         break;
     case PREFIX_OVERRIDE_DS:
-        buf_write_8(buf, 0x3e);
+        stage_write_8(stage, 0x3e);
         break;
     case PREFIX_OVERRIDE_ES:
-        buf_write_8(buf, 0x26);
+        stage_write_8(stage, 0x26);
         break;
     case PREFIX_OVERRIDE_FS:
-        buf_write_8(buf, 0x64);
+        stage_write_8(stage, 0x64);
         break;
     case PREFIX_OVERRIDE_GS:
-        buf_write_8(buf, 0x65);
+        stage_write_8(stage, 0x65);
         break;
     }
     if (prefix_group_3(instance)) {
-        buf_write_8(buf, 0x66);
+        stage_write_8(stage, 0x66);
     }
     if (prefix_group_4(instance)) {
-        buf_write_8(buf, 0x67);
+        stage_write_8(stage, 0x67);
+    }
+    // F2 and F3 go last since they double as mandatory prefixes, which
+    // belong right in front of REX and the opcode
+    switch (prefix_group_1(instance)) {
+    case PREFIX_REPNZ:
+        stage_write_8(stage, 0xf2);
+        break;
+    case PREFIX_REPZ:
+        stage_write_8(stage, 0xf3);
+        break;
     }
     if (prefix_has_rex(instance)) {
         uint8_t rex_byte = 0x40;
@@ -58,164 +67,444 @@ static inline void write_legacy_instance(buffer_t*        buf,
         rex_byte |= prefix_flag_r(instance) << 2;
         rex_byte |= prefix_flag_x(instance) << 1;
         rex_byte |= prefix_flag_b(instance);
-        buf_write_8(buf, rex_byte);
+        stage_write_8(stage, rex_byte);
     }
-    write_opcode(buf, instance);
-    write_modrm_sib(buf, instance);
-    write_disp(buf, instance);
-    write_imm(buf, instance);
+    write_opcode(stage, instance);
+    write_modrm_sib(stage, instance);
+    write_disp(stage, instance);
+    write_imm(stage, instance);
 }
 
-static inline void write_vex_instance(buffer_t*        buf,
+static inline void write_vex_instance(staging_t*       stage,
                                       instr_instance_t instance) {
     bool prefix_vex_short = !prefix_flag_x(instance) &&
                             !prefix_flag_b(instance) &&
                             !prefix_flag_w(instance) &&
                             (prefix_vex_map_select(instance) == 1);
     if (prefix_vex_short || prefix_vex_vexsize_override(instance)) {
-        uint8_t vex_byte_1 = 0;
+        // R and vvvv are stored inverted
+        uint8_t vex_byte_1 = 0xf8;
         vex_byte_1 ^= prefix_flag_r(instance) << 7;
         vex_byte_1 ^= prefix_vex_op_2(instance) << 3;
         vex_byte_1 |= prefix_vex_256(instance) << 2;
         vex_byte_1 |= prefix_vex_implicit(instance);
-        buf_write_8(buf, 0xc5);
-        buf_write_8(buf, vex_byte_1);
+        stage_write_8(stage, 0xc5);
+        stage_write_8(stage, vex_byte_1);
     }
     else {
-        uint8_t vex_byte_1 = 0;
+        // R, X, B and vvvv are stored inverted
+        uint8_t vex_byte_1 = 0xe0;
         vex_byte_1 ^= prefix_flag_r(instance) << 7;
         vex_byte_1 ^= prefix_flag_x(instance) << 6;
         vex_byte_1 ^= prefix_flag_b(instance) << 5;
         vex_byte_1 |= prefix_vex_map_select(instance);
-        uint8_t vex_byte_2 = 0;
+        uint8_t vex_byte_2 = 0x78;
         vex_byte_2 |= prefix_flag_w(instance) << 7;
         vex_byte_2 ^= prefix_vex_op_2(instance) << 3;
         vex_byte_2 |= prefix_vex_256(instance) << 2;
         vex_byte_2 |= prefix_vex_implicit(instance);
-        buf_write_8(buf, 0xc4);
-        buf_write_8(buf, vex_byte_1);
-        buf_write_8(buf, vex_byte_2);
+        stage_write_8(stage, 0xc4);
+        stage_write_8(stage, vex_byte_1);
+        stage_write_8(stage, vex_byte_2);
     }
-    write_opcode(buf, instance);
-    write_modrm_sib(buf, instance);
-    write_disp(buf, instance);
-    write_imm(buf, instance);
+    stage_write_8(stage, instance.opcode);
+    write_modrm_sib(stage, instance);
+    write_disp(stage, instance);
+    write_imm(stage, instance);
+}
 
+static inline void write_evex_instance(staging_t*       stage,
+                                       instr_instance_t instance) {
+    // R, X, B, R2, vvvv and V2 are stored inverted
+    uint8_t evex_byte_1 = 0xf0;
+    evex_byte_1 ^= prefix_flag_r(instance) << 7;
+    evex_byte_1 ^= prefix_flag_x(instance) << 6;
+    evex_byte_1 ^= prefix_flag_b(instance) << 5;
+    evex_byte_1 ^= prefix_evex_flag_r2(instance) << 4;
+    evex_byte_1 |= prefix_vex_map_select(instance);
+    uint8_t evex_byte_2 = 0x7c;
+    evex_byte_2 |= prefix_flag_w(instance) << 7;
+    evex_byte_2 ^= prefix_vex_op_2(instance) << 3;
+    evex_byte_2 |= prefix_evex_implicit(instance);
+    uint8_t evex_byte_3 = 0x08;
+    evex_byte_3 |= prefix_evex_zeroing(instance) << 7;
+    evex_byte_3 |= prefix_evex_size(instance) << 5;
+    evex_byte_3 |= prefix_evex_broadcast(instance) << 4;
+    evex_byte_3 ^= prefix_evex_flag_v2(instance) << 3;
+    evex_byte_3 |= prefix_evex_mask(instance);
+    stage_write_8(stage, 0x62);
+    stage_write_8(stage, evex_byte_1);
+    stage_write_8(stage, evex_byte_2);
+    stage_write_8(stage, evex_byte_3);
+    stage_write_8(stage, instance.opcode);
+    write_modrm_sib(stage, instance);
+    write_disp(stage, instance);
+    write_imm(stage, instance);
 }
 
-static inline void write_3dnow_instance(buffer_t*        buf,
+static inline void write_3dnow_instance(staging_t*       stage,
                                         instr_instance_t instance) {
-    buf_write_16(buf, 0x0f0f);
-    write_modrm_sib(buf, instance);
-    write_disp(buf, instance);
-    write_opcode(buf, instance);
+    stage_write_16(stage, 0x0f0f);
+    write_modrm_sib(stage, instance);
+    write_disp(stage, instance);
+    stage_write_8(stage, instance.opcode);
 }
 
-static inline void write_nop_instance(buffer_t*        buf,
-                                      instr_instance_t instance) {
-    uint64_t nop_length = instance_nop_length(instance);
-    for (; nop_length > 15; nop_length -= 15) {
-        for (int i = 1; i < 15; i++) {
-            buf_write_8(buf, 0x66);
-        }
-        write_opcode(buf, instance);
+// Recommended multi-byte nops: 0F 1F /0 with growing modrm/sib/disp forms
+// up to 9 bytes, then 66 and 2E prefixes for 10 and 11. Longer padding is
+// split into 11 byte nops, which every core decodes without prefix stalls.
+#define NOP_MAX_LEN 11
+
+static const uint8_t nop_sequences[NOP_MAX_LEN + 1][STAGING_SIZE] = {
+    [1]  = {0x90},
+    [2]  = {0x66, 0x90},
+    [3]  = {0x0f, 0x1f, 0x00},
+    [4]  = {0x0f, 0x1f, 0x40, 0x00},
+    [5]  = {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    [6]  = {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    [7]  = {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    [8]  = {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    [9]  = {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    [10] = {0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    [11] = {0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+static inline void write_nops(buffer_t* buf, uint64_t nop_length) {
+    while (nop_length) {
+        uint64_t chunk = nop_length > NOP_MAX_LEN ? NOP_MAX_LEN : nop_length;
+        staging_t stage = {.len = chunk};
+        memcpy(&stage.bytes, nop_sequences[chunk], STAGING_SIZE);
+        buf_commit(buf, stage);
+        nop_length -= chunk;
     }
-    if (nop_length) {
-        for (int i = 1; i < nop_length; i++) {
-            buf_write_8(buf, 0x66);
+}
+
+// Stages any valid instance other than a nop, callers commit the result
+// into a buffer that has STAGING_SIZE bytes free at the cursor.
+static inline void stage_instruction_instance(staging_t*       stage,
+                                              instr_instance_t instance) {
+    switch (instance_type(instance)) {
+    case INSTR_TYPE_LEGACY:
+        write_legacy_instance(stage, instance);
+        break;
+    case INSTR_TYPE_VEX:
+        write_vex_instance(stage, instance);
+        break;
+    case INSTR_TYPE_EVEX:
+        write_evex_instance(stage, instance);
+        break;
+    case INSTR_TYPE_3DNOW:
+        write_3dnow_instance(stage, instance);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////
+
+// JCC erratum mode. Some Intel cores stop caching the decoded uops of a
+// branch that crosses or ends on a 32 byte boundary. The same applies to a
+// cmp/test/add/sub/and/inc/dec that macro-fuses with the jcc after it. With
+// jcc_erratum.enabled set, the writer pads such branches with nops up to
+// the boundary. A fused pair is kept together by moving the already
+// written first half past the padding. jcc_erratum.padding counts the bytes
+// added. The mode is thread local like instr_error.
+
+#define JCC_ERRATUM_BOUNDARY 32
+
+typedef struct {
+    bool enabled;
+    uint64_t padding;
+    // the last instruction written, if it can fuse with a following jcc
+    uint8_t* fused_data;
+    uint64_t fused_start;
+    uint64_t fused_end;
+} jcc_erratum_t;
+
+static _Thread_local jcc_erratum_t jcc_erratum;
+
+inline static bool instance_is_jcc(instr_instance_t instance) {
+    return instance_is_legacy(instance) && (
+        (opcode_map(instance) == OPCODE_MAP_NONE && (instance.opcode & 0xf0) == 0x70) ||
+        (opcode_map(instance) == OPCODE_MAP_0F && (instance.opcode & 0xf0) == 0x80));
+}
+
+// jcc, jmp, call, ret, loop/jrcxz and indirect jmp/call
+inline static bool instance_is_branch(instr_instance_t instance) {
+    if (instance_is_jcc(instance)) {
+        return true;
+    }
+    if (!instance_is_legacy(instance) || opcode_map(instance) != OPCODE_MAP_NONE) {
+        return false;
+    }
+    switch (instance.opcode) {
+    case 0xc2: case 0xc3:
+    case 0xe0: case 0xe1: case 0xe2: case 0xe3:
+    case 0xe8: case 0xe9: case 0xeb:
+        return true;
+    case 0xff:
+        return instance.modrm.reg >= 2 && instance.modrm.reg <= 5;
+    }
+    return false;
+}
+
+// Instructions that macro-fuse with a following jcc: cmp and test with
+// register or memory operands, and add/sub/and/inc/dec that write a
+// register. Memory operands combined with an immediate never fuse. rip
+// relative operands are left out since the writer may move the first half
+// of a pair, which would point its disp32 somewhere else.
+inline static bool instance_is_fusible(instr_instance_t instance) {
+    if (!instance_is_legacy(instance) || opcode_map(instance) != OPCODE_MAP_NONE) {
+        return false;
+    }
+    if (has_rip_disp(instance)) {
+        return false;
+    }
+    uint8_t op = instance.opcode;
+    bool reg_dest = instance.modrm.mod == MOD_DIRECT;
+    if (op < 0x40 && (op & 7) <= 5) {
+        switch (op >> 3) {
+        case 7:         // cmp
+            return true;
+        case 0:         // add
+        case 4:         // and
+        case 5:         // sub
+            return (op & 7) >= 2 || reg_dest;
         }
-        write_opcode(buf, instance);
+        return false;
+    }
+    switch (op) {
+    case 0x80: case 0x81: case 0x83:
+        return reg_dest &&
+               (instance.modrm.reg == 0 || instance.modrm.reg == 4 ||
+                instance.modrm.reg == 5 || instance.modrm.reg == 7);
+    case 0x84: case 0x85:
+    case 0xa8: case 0xa9:
+        return true;
+    case 0xf6: case 0xf7:
+        return reg_dest && instance.modrm.reg == 0;
+    case 0xfe: case 0xff:
+        return reg_dest && instance.modrm.reg <= 1;
     }
+    return false;
 }
 
-static inline void write_instruction_instance(buffer_t*        buf,
+// padding that moves code occupying [start, end) to the next boundary if it
+// crosses or ends on one
+inline static uint64_t jcc_erratum_padding(uint64_t start, uint64_t end) {
+    if (start / JCC_ERRATUM_BOUNDARY == end / JCC_ERRATUM_BOUNDARY) {
+        return 0;
+    }
+    return -start & (JCC_ERRATUM_BOUNDARY - 1);
+}
+
+#define jcc_erratum_fused_at(buf) \
+    (jcc_erratum.fused_data == (buf)->data && jcc_erratum.fused_end == (buf)->cursor)
+
+// anything that refers to the cursor, like a label, ends a fusible pair
+inline static void jcc_erratum_barrier(void) {
+    jcc_erratum.fused_data = NULL;
+}
+
+// padding the mode puts in front of a len byte branch written at the cursor
+inline static uint64_t jcc_erratum_branch_padding(buffer_t* buf,
+                                                  uint64_t  len,
+                                                  bool      jcc) {
+    if (!jcc_erratum.enabled) {
+        return 0;
+    }
+    uint64_t from = jcc && jcc_erratum_fused_at(buf) ? jcc_erratum.fused_start : buf->cursor;
+    return jcc_erratum_padding(from, buf->cursor + len);
+}
+
+static bool write_instance_jcc_erratum(buffer_t*        buf,
+                                       instr_instance_t instance) {
+    bool jcc = instance_is_jcc(instance);
+    uint64_t padding = 0;
+    if (instance_is_branch(instance)) {
+        padding = jcc_erratum_branch_padding(buf, instruction_length(instance), jcc);
+    }
+    if (!buf_reserve(buf, padding + 2 * STAGING_SIZE)) {
+        return false;
+    }
+
+    if (padding) {
+        uint64_t from = jcc && jcc_erratum_fused_at(buf) ? jcc_erratum.fused_start : buf->cursor;
+        staging_t moved = {.len = buf->cursor - from};
+        memcpy(&moved.bytes, buf->data + from, moved.len);
+        buf->cursor = from;
+        write_nops(buf, padding);
+        buf_commit(buf, moved);
+        jcc_erratum.padding += padding;
+    }
+
+    uint64_t start = buf->cursor;
+    staging_t stage = {0};
+    stage_instruction_instance(&stage, instance);
+    buf_commit(buf, stage);
+
+    jcc_erratum.fused_data = NULL;
+    if (instance_is_fusible(instance)) {
+        jcc_erratum.fused_data = buf->data;
+        jcc_erratum.fused_start = start;
+        jcc_erratum.fused_end = buf->cursor;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////
+
+static inline bool write_instruction_instance(buffer_t*        buf,
                                               instr_instance_t instance) {
     if (instance_is_invalid(instance)) {
-        return;
+        return false;
+    }
+
+    if (instance_is_padding(instance)) {
+        uint64_t nop_length = instruction_length_at(instance, buf->cursor);
+        if (!buf_reserve(buf, nop_length + STAGING_SIZE)) {
+            return false;
+        }
+        write_nops(buf, nop_length);
+        jcc_erratum_barrier();
+        return true;
     }
 
+    if (__builtin_expect(jcc_erratum.enabled, false)) {
+        return write_instance_jcc_erratum(buf, instance);
+    }
+
+    // one capacity check per instruction, with room for the full store
+    if (!buf_reserve(buf, STAGING_SIZE)) {
+        return false;
+    }
+
+    staging_t stage = {0};
+    stage_instruction_instance(&stage, instance);
+    buf_commit(buf, stage);
+    return true;
+}
+
+// padding an align instance needs at offset
+static inline uint64_t align_padding(instr_instance_t instance, uint64_t offset) {
+    uint64_t padding = -offset & (instance_alignment(instance) - 1);
+    return padding <= instance_align_max_skip(instance) ? padding : 0;
+}
+
+// Exact number of bytes write_instruction_instance produces for instance,
+// computed from the instance alone so sizing passes can run it over whole
+// functions before anything is written. Alignment depends on where it ends
+// up, so align instances report the most padding they can produce and
+// instruction_length_at gives the exact figure.
+static inline uint64_t instruction_length(instr_instance_t instance) {
+    uint64_t len = 0;
+
     switch (instance_type(instance)) {
     case INSTR_TYPE_LEGACY:
-        write_legacy_instance(buf, instance);
+        len += prefix_group_1(instance) != 0;
+        len += prefix_group_2(instance) != 0;
+        len += prefix_group_3(instance);
+        len += prefix_group_4(instance);
+        len += prefix_has_rex(instance);
+        len += opcode_len(instance);
         break;
     case INSTR_TYPE_VEX:
-        write_vex_instance(buf, instance);
+        bool prefix_vex_short = !prefix_flag_x(instance) &&
+                                !prefix_flag_b(instance) &&
+                                !prefix_flag_w(instance) &&
+                                (prefix_vex_map_select(instance) == 1);
+        len += (prefix_vex_short || prefix_vex_vexsize_override(instance)) ? 2 : 3;
+        len += 1;
+        break;
+    case INSTR_TYPE_EVEX:
+        len += 4 + 1;
         break;
     case INSTR_TYPE_3DNOW:
-        write_3dnow_instance(buf, instance);
+        len += 2 + 1;
         break;
     case INSTR_TYPE_NOP:
-        write_nop_instance(buf, instance);
-        break;
+        return instance_nop_length(instance);
+    case INSTR_TYPE_ALIGN:
+        return instance_alignment(instance) - 1 < instance_align_max_skip(instance)
+            ? instance_alignment(instance) - 1
+            : instance_align_max_skip(instance);
+    default:
+        return 0;
     }
+
+    len += has_modrm(instance);
+    len += has_modrm(instance) && has_sib(instance);
+    len += arg_size_bytes(disp_size(instance));
+    len += arg_size_bytes(imm_size(instance));
+    return len;
 }
 
-static inline void write_opcode(buffer_t* buf, instr_instance_t instance) {
-    uint32_t opcode_val = opcode_val(instance);
-    if (opcode_len(instance) == 1) {
-        buf_write_8(buf, opcode_val & 0xff);
-        return;
-    }
-    if (opcode_len(instance) == 2) {
-        buf_write_8(buf, (opcode_val >> 8) & 0xff);
-        buf_write_8(buf, opcode_val & 0xff);
-        return;
+// exact length of instance when written at offset
+static inline uint64_t instruction_length_at(instr_instance_t instance,
+                                             uint64_t         offset) {
+    if (instance_is_align(instance)) {
+        return align_padding(instance, offset);
     }
-    if (opcode_len(instance) == 3) {
-        buf_write_8(buf, (opcode_val >> 16) & 0xff);
-        buf_write_8(buf, (opcode_val >> 8) & 0xff);
-        buf_write_8(buf, opcode_val & 0xff);
-        return;
+    return instruction_length(instance);
+}
+
+static inline void write_opcode(staging_t* stage, instr_instance_t instance) {
+    switch (opcode_map(instance)) {
+    case OPCODE_MAP_0F:
+        stage_write_8(stage, 0x0f);
+        break;
+    case OPCODE_MAP_0F38:
+        stage_write_16(stage, 0x380f);
+        break;
+    case OPCODE_MAP_0F3A:
+        stage_write_16(stage, 0x3a0f);
+        break;
     }
-    printf("weird opcode length\n");
+    stage_write_8(stage, instance.opcode);
 }
 
-static inline void write_disp(buffer_t* buf, instr_instance_t instance) {
+static inline void write_disp(staging_t* stage, instr_instance_t instance) {
     switch (disp_size(instance)) {
     case ARG_SIZE_NONE:
         return;
     case ARG_SIZE_8:
-        buf_write_8(buf, instance.disp & 0xff);
+        stage_write_8(stage, instance.disp & 0xff);
         return;
     case ARG_SIZE_16:
-        buf_write_16(buf, instance.disp & 0xffff);
+        stage_write_16(stage, instance.disp & 0xffff);
         return;
     case ARG_SIZE_32:
-        buf_write_32(buf, instance.disp & 0xffffffff);
-        return;
-    case ARG_SIZE_64:
-        buf_write_64(buf, instance.disp);
+        stage_write_32(stage, instance.disp & 0xffffffff);
         return;
     }
 }
 
-static inline void write_imm(buffer_t* buf, instr_instance_t instance) {
+static inline void write_imm(staging_t* stage, instr_instance_t instance) {
     switch (imm_size(instance)) {
     case ARG_SIZE_NONE:
         return;
     case ARG_SIZE_8:
-        buf_write_8(buf, instance.imm & 0xff);
+        stage_write_8(stage, instance.imm & 0xff);
         return;
     case ARG_SIZE_16:
-        buf_write_16(buf, instance.imm & 0xffff);
+        stage_write_16(stage, instance.imm & 0xffff);
         return;
     case ARG_SIZE_32:
-        buf_write_32(buf, instance.imm & 0xffffffff);
+        stage_write_32(stage, instance.imm & 0xffffffff);
         return;
     case ARG_SIZE_64:
-        buf_write_64(buf, instance.imm);
+        stage_write_64(stage, instance_imm(instance));
         return;
     }
 }
 
-static inline void write_modrm_sib(buffer_t* buf, instr_instance_t instance) {
+static inline void write_modrm_sib(staging_t* stage, instr_instance_t instance) {
     if (has_modrm(instance)) {
         modrm_t modrm = instance.modrm;
         uint8_t modrm_byte = 0;
         modrm_byte |= modrm.mod << 6;
         modrm_byte |= modrm.reg << 3;
         modrm_byte |= modrm.rm;
-        buf_write_8(buf, modrm_byte);
+        stage_write_8(stage, modrm_byte);
 
         if (has_sib(instance)) {
             sib_t sib = instance.sib;
@@ -223,7 +512,7 @@ static inline void write_modrm_sib(buffer_t* buf, instr_instance_t instance) {
             sib_byte |= sib.scale << 6;
             sib_byte |= sib.index << 3;
             sib_byte |= sib.base;
-            buf_write_8(buf, sib_byte);
+            stage_write_8(stage, sib_byte);
         }
     }
 }
@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////
+
+// Labels name buffer offsets. A label is created unbound, branches to it
+// leave a rel32 field behind as a fixup, and binding the label to the
+// cursor patches every fixup waiting on it. Each label keeps its fixups as
+// a singly linked list threaded through the fixup pool, so binding touches
+// only the branches that actually reference it.
+
+#define LABEL_NONE ((uint32_t) -1)
+#define LABEL_UNBOUND ((uint64_t) -1)
+
+typedef struct {
+    uint64_t offset;
+    uint32_t fixups;
+    // 1 + index of the OP_LABEL defining the label in the block relax_block
+    // is working on, 0 otherwise
+    uint32_t block_index;
+} label_entry_t;
+
+typedef struct {
+    // offset of the rel32 field, which is always the last 4 bytes of the
+    // branch, so the displacement is measured from offset + 4
+    uint64_t offset;
+    uint32_t next;
+} fixup_t;
+
+typedef struct {
+    buffer_t entries;
+    buffer_t fixups;
+    buffer_t scratch;
+} labels_t;
+
+#define label_entry(labels, label) (((label_entry_t*) (labels)->entries.data) + (label))
+#define label_fixup_entry(labels, fixup) (((fixup_t*) (labels)->fixups.data) + (fixup))
+#define num_labels(labels) ((labels)->entries.cursor / sizeof(label_entry_t))
+
+#define label_is_valid(labels, label) ((label) < num_labels(labels))
+#define label_is_bound(labels, label) (label_entry(labels, label)->offset != LABEL_UNBOUND)
+
+////////////////////////////////////////////////////////////////
+
+static inline labels_t alloc_labels(void) {
+    return (labels_t) {
+        .entries = alloc_buf_growable(1ull << 32, BUF_PAGE_SIZE),
+        .fixups = alloc_buf_growable(1ull << 32, BUF_PAGE_SIZE),
+        .scratch = alloc_buf_growable(1ull << 36, BUF_PAGE_SIZE)
+    };
+}
+
+static inline void free_labels(labels_t* labels) {
+    free_buf(&labels->entries);
+    free_buf(&labels->fixups);
+    free_buf(&labels->scratch);
+}
+
+// forgets every label and fixup, keeping the memory for the next function
+static inline void labels_reset(labels_t* labels) {
+    labels->entries.cursor = 0;
+    labels->fixups.cursor = 0;
+}
+
+// returns LABEL_NONE when out of space
+static inline uint32_t label_new(labels_t* labels) {
+    if (!buf_reserve(&labels->entries, sizeof(label_entry_t))) {
+        return LABEL_NONE;
+    }
+    uint32_t label = num_labels(labels);
+    *label_entry(labels, label) = (label_entry_t) {
+        .offset = LABEL_UNBOUND,
+        .fixups = LABEL_NONE
+    };
+    labels->entries.cursor += sizeof(label_entry_t);
+    return label;
+}
+
+// remembers that the rel32 field at offset has to point at label
+static inline bool label_add_fixup(labels_t* labels,
+                                   uint32_t  label,
+                                   uint64_t  offset) {
+    if (!buf_reserve(&labels->fixups, sizeof(fixup_t))) {
+        return false;
+    }
+    uint32_t fixup = labels->fixups.cursor / sizeof(fixup_t);
+    *label_fixup_entry(labels, fixup) = (fixup_t) {
+        .offset = offset,
+        .next = label_entry(labels, label)->fixups
+    };
+    label_entry(labels, label)->fixups = fixup;
+    labels->fixups.cursor += sizeof(fixup_t);
+    return true;
+}
+
+// binds label to the cursor of buf and patches the branches waiting on it
+static inline bool label_bind(labels_t* labels, buffer_t* buf, uint32_t label) {
+    if (!label_is_valid(labels, label) || label_is_bound(labels, label)) {
+        return false;
+    }
+    label_entry_t* entry = label_entry(labels, label);
+    entry->offset = buf->cursor;
+    jcc_erratum_barrier();
+
+    for (uint32_t fixup = entry->fixups; fixup != LABEL_NONE;) {
+        fixup_t* f = label_fixup_entry(labels, fixup);
+        int64_t rel = (int64_t) (entry->offset - (f->offset + 4));
+        if (rel != (int32_t) rel) {
+            return false;
+        }
+        buf_patch_32(buf, f->offset, rel);
+        fixup = f->next;
+    }
+    entry->fixups = LABEL_NONE;
+    return true;
+}
+
+// number of labels that branches point at but that were never bound
+static inline uint64_t labels_unresolved(labels_t* labels) {
+    uint64_t unresolved = 0;
+    for (uint32_t label = 0; label < num_labels(labels); label++) {
+        unresolved += label_entry(labels, label)->fixups != LABEL_NONE;
+    }
+    return unresolved;
+}
@@ -6,18 +6,40 @@ typedef struct {
     uint64_t disp;
     register_t base;
     register_t index;
+    register_t segment;
     uint8_t scale;
     uint8_t disp_size;
     uint8_t size;
 } memory_t;
 
+// Memory operands as stored inside arg_t: 7 bytes holding a 32 bit
+// displacement and base/index registers that are always general purpose or
+// ip registers, whose types fit in 3 bits. Displacements that don't sign
+// extend from 32 bits live in the arg_wide pool and disp holds their slot.
+// segment is the id of the override segment register plus one, 0 for none.
+typedef struct __attribute__((packed)) {
+    uint32_t disp;
+    uint8_t base_id : 4;
+    uint8_t index_id : 4;
+    uint8_t base_type : 3;
+    uint8_t index_type : 3;
+    uint8_t scale : 2;
+    uint8_t disp_size : 4;
+    uint8_t wide : 1;
+    uint8_t segment : 3;
+} packed_memory_t;
+
 #define MEMORY_SCALE_1 0b00
 #define MEMORY_SCALE_2 0b01
 #define MEMORY_SCALE_4 0b10
 #define MEMORY_SCALE_8 0b11
 
+// disp_size that lets the encoder pick the shortest displacement
+#define MEMORY_DISP_AUTO ARG_SIZE_ANY
+
 #define memory_base(mem) ((mem).base)
 #define memory_index(mem) ((mem).index)
+#define memory_segment(mem) ((mem).segment)
 #define memory_scale(mem) ((mem).scale)
 #define memory_disp(mem) ((mem).disp)
 #define memory_disp_size(mem) ((mem).disp_size)
@@ -28,12 +50,19 @@ inline static void print_mem(memory_t mem) {
     if (memory_size(mem) != ARG_SIZE_8  &&
         memory_size(mem) != ARG_SIZE_16 &&
         memory_size(mem) != ARG_SIZE_32 &&
-        memory_size(mem) != ARG_SIZE_64) {
+        memory_size(mem) != ARG_SIZE_64 &&
+        memory_size(mem) != ARG_SIZE_128 &&
+        memory_size(mem) != ARG_SIZE_256 &&
+        memory_size(mem) != ARG_SIZE_512) {
         printf("mem(BAD)");
         return;
     }
     register_t base = memory_base(mem);
     register_t index = memory_index(mem);
+    if (!register_is_none(memory_segment(mem))) {
+        print_reg(memory_segment(mem));
+        printf(":");
+    }
     printf("mem(");
     print_reg(base);
 
@@ -78,6 +107,10 @@ inline static void print_mem(memory_t mem) {
         uint64_t disp64 = memory_disp(mem);
         printf(" + (%ld / %lu / 0x%016lx))", disp64, disp64, disp64);
         break;
+    case MEMORY_DISP_AUTO:
+        int64_t disp_auto = memory_disp(mem);
+        printf(" + (%ld auto))", disp_auto);
+        break;
     }
     printf(")");
 }
@@ -2,9 +2,10 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+// ids go up to 31 for the EVEX only xmm/ymm/zmm registers 16-31
 typedef struct {
-    uint8_t id : 4;
-    uint8_t type : 4;
+    uint8_t id : 5;
+    uint8_t type : 5;
 } register_t;
 
 #define REGISTER_TYPE_NONE        0
@@ -22,6 +23,16 @@ typedef struct {
 #define REGISTER_TYPE_SEGMENT    12
 #define REGISTER_TYPE_CONTROL    13
 #define REGISTER_TYPE_DEBUG      14
+#define REGISTER_TYPE_ZMM        15
+#define REGISTER_TYPE_MASK       16
+
+// Write mask operand of an EVEX instruction: the opmask register the
+// result is masked with and whether masked out elements are zeroed rather
+// than left alone. k0 means no masking.
+typedef struct {
+    uint8_t id : 3;
+    uint8_t zeroing : 1;
+} opmask_t;
 
 register_t REGISTER_NONE = {.type = REGISTER_TYPE_NONE};
 
@@ -29,6 +40,7 @@ register_t REGISTER_NONE = {.type = REGISTER_TYPE_NONE};
 #define register_type(reg) ((reg).type)
 #define register_id_low(reg) (register_id(reg) & 0b0111)
 #define register_id_high(reg) (register_id(reg) & 0b1000)
+#define register_id_ext(reg) (register_id(reg) & 0b10000)
 #define register_is_none(reg) (register_type(reg) == REGISTER_TYPE_NONE)
 #define register_is_8(reg) (register_type(reg) == REGISTER_TYPE_8_BIT)
 #define register_is_16(reg) (register_type(reg) == REGISTER_TYPE_16_BIT)
@@ -44,6 +56,14 @@ register_t REGISTER_NONE = {.type = REGISTER_TYPE_NONE};
 #define register_is_segment(reg) (register_type(reg) == REGISTER_TYPE_SEGMENT)
 #define register_is_control(reg) (register_type(reg) == REGISTER_TYPE_CONTROL)
 #define register_is_debug(reg) (register_type(reg) == REGISTER_TYPE_DEBUG)
+#define register_is_zmm(reg) (register_type(reg) == REGISTER_TYPE_ZMM)
+#define register_is_mask(reg) (register_type(reg) == REGISTER_TYPE_MASK)
+
+#define register_is_vector(reg) ( \
+    register_is_xmm(reg) || \
+    register_is_ymm(reg) || \
+    register_is_zmm(reg) \
+)
 
 #define register_is_general(reg) ( \
     register_is_8(reg)  || \
@@ -82,6 +102,45 @@ inline static uint8_t register_size_general(register_t reg) {
     }
 }
 
+// The kind of register an operand slot takes. Sizes don't tell them apart,
+// rcx, mm1 and k1 are all 64 bits, and cr0 is 32. x87 and the ip registers
+// are in REGISTER_CLASS_OTHER, which no schema takes.
+#define REGISTER_CLASS_GPR     0
+#define REGISTER_CLASS_VECTOR  1
+#define REGISTER_CLASS_MASK    2
+#define REGISTER_CLASS_SEGMENT 3
+#define REGISTER_CLASS_CONTROL 4
+#define REGISTER_CLASS_DEBUG   5
+#define REGISTER_CLASS_MMX     6
+#define REGISTER_CLASS_OTHER   7
+
+inline static uint8_t register_class(register_t reg) {
+    switch (register_type(reg)) {
+    case REGISTER_TYPE_8_BIT:
+    case REGISTER_TYPE_8_BIT_REX:
+    case REGISTER_TYPE_16_BIT:
+    case REGISTER_TYPE_32_BIT:
+    case REGISTER_TYPE_64_BIT:
+        return REGISTER_CLASS_GPR;
+    case REGISTER_TYPE_XMM:
+    case REGISTER_TYPE_YMM:
+    case REGISTER_TYPE_ZMM:
+        return REGISTER_CLASS_VECTOR;
+    case REGISTER_TYPE_MASK:
+        return REGISTER_CLASS_MASK;
+    case REGISTER_TYPE_SEGMENT:
+        return REGISTER_CLASS_SEGMENT;
+    case REGISTER_TYPE_CONTROL:
+        return REGISTER_CLASS_CONTROL;
+    case REGISTER_TYPE_DEBUG:
+        return REGISTER_CLASS_DEBUG;
+    case REGISTER_TYPE_MMX:
+        return REGISTER_CLASS_MMX;
+    default:
+        return REGISTER_CLASS_OTHER;
+    }
+}
+
 inline static uint8_t register_size(register_t reg) {
     switch (register_type(reg)) {
     case REGISTER_TYPE_8_BIT:
@@ -98,11 +157,14 @@ inline static uint8_t register_size(register_t reg) {
     case REGISTER_TYPE_64_BIT:
     case REGISTER_TYPE_64_BIT_IP:
     case REGISTER_TYPE_MMX:
+    case REGISTER_TYPE_MASK:
         return ARG_SIZE_64;
     case REGISTER_TYPE_XMM:
         return ARG_SIZE_128;
     case REGISTER_TYPE_YMM:
         return ARG_SIZE_256;
+    case REGISTER_TYPE_ZMM:
+        return ARG_SIZE_512;
     default:
         return ARG_SIZE_NONE;
     }
@@ -157,6 +219,12 @@ inline static void print_reg(register_t reg) {
     case REGISTER_TYPE_DEBUG:
         printf("reg(DEBUG, %d)", reg_id);
         break;
+    case REGISTER_TYPE_ZMM:
+        printf("reg(ZMM, %d)", reg_id);
+        break;
+    case REGISTER_TYPE_MASK:
+        printf("reg(MASK, %d)", reg_id);
+        break;
     default:
         printf("reg(BAD)");
         break;
@@ -6,6 +6,8 @@
 #define MM0 arg_reg_mmx(0)
 #define XMM0 arg_reg_xmm(0)
 #define YMM0 arg_reg_ymm(0)
+#define ZMM0 arg_reg_zmm(0)
+#define K0 arg_reg_mask(0)
 #define ES arg_reg_segment(0)
 #define CR0 arg_reg_control(0)
 #define DR0 arg_reg_debug(0)
@@ -17,6 +19,8 @@
 #define MM1 arg_reg_mmx(1)
 #define XMM1 arg_reg_xmm(1)
 #define YMM1 arg_reg_ymm(1)
+#define ZMM1 arg_reg_zmm(1)
+#define K1 arg_reg_mask(1)
 #define CS arg_reg_segment(1)
 #define CR1 arg_reg_control(1)
 #define DR1 arg_reg_debug(1)
@@ -28,6 +32,8 @@
 #define MM2 arg_reg_mmx(2)
 #define XMM2 arg_reg_xmm(2)
 #define YMM2 arg_reg_ymm(2)
+#define ZMM2 arg_reg_zmm(2)
+#define K2 arg_reg_mask(2)
 #define SS arg_reg_segment(2)
 #define CR2 arg_reg_control(2)
 #define DR2 arg_reg_debug(2)
@@ -39,6 +45,8 @@
 #define MM3 arg_reg_mmx(3)
 #define XMM3 arg_reg_xmm(3)
 #define YMM3 arg_reg_ymm(3)
+#define ZMM3 arg_reg_zmm(3)
+#define K3 arg_reg_mask(3)
 #define DS arg_reg_segment(3)
 #define CR3 arg_reg_control(3)
 #define DR3 arg_reg_debug(3)
@@ -50,6 +58,8 @@
 #define MM4 arg_reg_mmx(4)
 #define XMM4 arg_reg_xmm(4)
 #define YMM4 arg_reg_ymm(4)
+#define ZMM4 arg_reg_zmm(4)
+#define K4 arg_reg_mask(4)
 #define FS arg_reg_segment(4)
 #define CR4 arg_reg_control(4)
 #define DR4 arg_reg_debug(4)
@@ -61,6 +71,8 @@
 #define MM5 arg_reg_mmx(5)
 #define XMM5 arg_reg_xmm(5)
 #define YMM5 arg_reg_ymm(5)
+#define ZMM5 arg_reg_zmm(5)
+#define K5 arg_reg_mask(5)
 #define GS arg_reg_segment(5)
 #define CR5 arg_reg_control(5)
 #define DR5 arg_reg_debug(5)
@@ -72,6 +84,8 @@
 #define MM6 arg_reg_mmx(6)
 #define XMM6 arg_reg_xmm(6)
 #define YMM6 arg_reg_ymm(6)
+#define ZMM6 arg_reg_zmm(6)
+#define K6 arg_reg_mask(6)
 #define CR6 arg_reg_control(6)
 #define DR6 arg_reg_debug(6)
 #define BH arg_reg_8(7)
@@ -82,6 +96,8 @@
 #define MM7 arg_reg_mmx(7)
 #define XMM7 arg_reg_xmm(7)
 #define YMM7 arg_reg_ymm(7)
+#define ZMM7 arg_reg_zmm(7)
+#define K7 arg_reg_mask(7)
 #define CR7 arg_reg_control(7)
 #define DR7 arg_reg_debug(7)
 #define R8L arg_reg_8(8)
@@ -91,6 +107,7 @@
 #define MM0_ALT arg_reg_mmx(8)
 #define XMM8 arg_reg_xmm(8)
 #define YMM8 arg_reg_ymm(8)
+#define ZMM8 arg_reg_zmm(8)
 #define ES_ALT arg_reg_segment(8)
 #define CR8 arg_reg_control(8)
 #define DR8 arg_reg_debug(8)
@@ -101,6 +118,7 @@
 #define MM1_ALT arg_reg_mmx(9)
 #define XMM9 arg_reg_xmm(9)
 #define YMM9 arg_reg_ymm(9)
+#define ZMM9 arg_reg_zmm(9)
 #define CS_ALT arg_reg_segment(9)
 #define CR9 arg_reg_control(9)
 #define DR9 arg_reg_debug(9)
@@ -111,6 +129,7 @@
 #define MM2_ALT arg_reg_mmx(10)
 #define XMM10 arg_reg_xmm(10)
 #define YMM10 arg_reg_ymm(10)
+#define ZMM10 arg_reg_zmm(10)
 #define SS_ALT arg_reg_segment(10)
 #define CR10 arg_reg_control(10)
 #define DR10 arg_reg_debug(10)
@@ -121,6 +140,7 @@
 #define MM3_ALT arg_reg_mmx(11)
 #define XMM11 arg_reg_xmm(11)
 #define YMM11 arg_reg_ymm(11)
+#define ZMM11 arg_reg_zmm(11)
 #define DS_ALT arg_reg_segment(11)
 #define CR11 arg_reg_control(11)
 #define DR11 arg_reg_debug(11)
@@ -131,6 +151,7 @@
 #define MM4_ALT arg_reg_mmx(12)
 #define XMM12 arg_reg_xmm(12)
 #define YMM12 arg_reg_ymm(12)
+#define ZMM12 arg_reg_zmm(12)
 #define FS_ALT arg_reg_segment(12)
 #define CR12 arg_reg_control(12)
 #define DR12 arg_reg_debug(12)
@@ -141,6 +162,7 @@
 #define MM5_ALT arg_reg_mmx(13)
 #define XMM13 arg_reg_xmm(13)
 #define YMM13 arg_reg_ymm(13)
+#define ZMM13 arg_reg_zmm(13)
 #define GS_ALT arg_reg_segment(13)
 #define CR13 arg_reg_control(13)
 #define DR13 arg_reg_debug(13)
@@ -151,6 +173,7 @@
 #define MM6_ALT arg_reg_mmx(14)
 #define XMM14 arg_reg_xmm(14)
 #define YMM14 arg_reg_ymm(14)
+#define ZMM14 arg_reg_zmm(14)
 #define CR14 arg_reg_control(14)
 #define DR14 arg_reg_debug(14)
 #define R15L arg_reg_8(15)
@@ -160,9 +183,59 @@
 #define MM7_ALT arg_reg_mmx(15)
 #define XMM15 arg_reg_xmm(15)
 #define YMM15 arg_reg_ymm(15)
+#define ZMM15 arg_reg_zmm(15)
 #define CR15 arg_reg_control(15)
 #define DR15 arg_reg_debug(15)
 
+#define XMM16 arg_reg_xmm(16)
+#define YMM16 arg_reg_ymm(16)
+#define ZMM16 arg_reg_zmm(16)
+#define XMM17 arg_reg_xmm(17)
+#define YMM17 arg_reg_ymm(17)
+#define ZMM17 arg_reg_zmm(17)
+#define XMM18 arg_reg_xmm(18)
+#define YMM18 arg_reg_ymm(18)
+#define ZMM18 arg_reg_zmm(18)
+#define XMM19 arg_reg_xmm(19)
+#define YMM19 arg_reg_ymm(19)
+#define ZMM19 arg_reg_zmm(19)
+#define XMM20 arg_reg_xmm(20)
+#define YMM20 arg_reg_ymm(20)
+#define ZMM20 arg_reg_zmm(20)
+#define XMM21 arg_reg_xmm(21)
+#define YMM21 arg_reg_ymm(21)
+#define ZMM21 arg_reg_zmm(21)
+#define XMM22 arg_reg_xmm(22)
+#define YMM22 arg_reg_ymm(22)
+#define ZMM22 arg_reg_zmm(22)
+#define XMM23 arg_reg_xmm(23)
+#define YMM23 arg_reg_ymm(23)
+#define ZMM23 arg_reg_zmm(23)
+#define XMM24 arg_reg_xmm(24)
+#define YMM24 arg_reg_ymm(24)
+#define ZMM24 arg_reg_zmm(24)
+#define XMM25 arg_reg_xmm(25)
+#define YMM25 arg_reg_ymm(25)
+#define ZMM25 arg_reg_zmm(25)
+#define XMM26 arg_reg_xmm(26)
+#define YMM26 arg_reg_ymm(26)
+#define ZMM26 arg_reg_zmm(26)
+#define XMM27 arg_reg_xmm(27)
+#define YMM27 arg_reg_ymm(27)
+#define ZMM27 arg_reg_zmm(27)
+#define XMM28 arg_reg_xmm(28)
+#define YMM28 arg_reg_ymm(28)
+#define ZMM28 arg_reg_zmm(28)
+#define XMM29 arg_reg_xmm(29)
+#define YMM29 arg_reg_ymm(29)
+#define ZMM29 arg_reg_zmm(29)
+#define XMM30 arg_reg_xmm(30)
+#define YMM30 arg_reg_ymm(30)
+#define ZMM30 arg_reg_zmm(30)
+#define XMM31 arg_reg_xmm(31)
+#define YMM31 arg_reg_ymm(31)
+#define ZMM31 arg_reg_zmm(31)
+
 #define SPL arg_reg_8_rex(4)
 #define BPL arg_reg_8_rex(5)
 #define SIL arg_reg_8_rex(6)